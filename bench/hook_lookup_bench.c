@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hook.h"
+#include "util.h"
+
+// Compares syscall hook lookup through the SoA tables in hook.c with the
+// previous array-of-structs layout, reproduced here as the baseline.
+//
+//   perf stat -e cache-references,cache-misses ./hook_lookup_bench soa
+//   perf stat -e cache-references,cache-misses ./hook_lookup_bench aos
+
+#define BENCH_HOOKS MAX_SYSCALL_HANDLERS
+#define BENCH_LOOKUPS 20000000ull
+
+typedef struct {
+    hook_type_t type;
+    uint64_t id;
+    uint64_t region_start;
+    uint64_t region_end;
+    hook_handler_func_t handler;
+} aos_handler_t;
+
+static aos_handler_t *aos_table;
+
+static int bench_handler(const trap_event_t *event) {
+    return (int)event->data;
+}
+
+static hook_handler_func_t aos_lookup(uint64_t id) {
+    for (int i = 0; i < BENCH_HOOKS; i++) {
+        if (aos_table[i].type == HOOK_TYPE_SYSCALL &&
+            aos_table[i].id == id &&
+            aos_table[i].handler) {
+            return aos_table[i].handler;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int use_aos = argc > 1 && strcmp(argv[1], "aos") == 0;
+
+    if (hook_init() != 0) {
+        return EXIT_FAILURE;
+    }
+
+    aos_table = calloc(BENCH_HOOKS, sizeof(aos_handler_t));
+    if (!aos_table) {
+        hook_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < BENCH_HOOKS; i++) {
+        register_hook(HOOK_TYPE_SYSCALL, i * 7, 0, 0, bench_handler);
+        aos_table[i].type = HOOK_TYPE_SYSCALL;
+        aos_table[i].id = i * 7;
+        aos_table[i].handler = bench_handler;
+    }
+
+    uint64_t state = 88172645463325252ull;
+    uint64_t hits = 0;
+    uint64_t start = now_ns();
+
+    for (uint64_t n = 0; n < BENCH_LOOKUPS; n++) {
+        // xorshift keeps the key stream unpredictable but cheap.
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint64_t id = (state % BENCH_HOOKS) * 7;
+
+        hook_handler_func_t handler = use_aos ? aos_lookup(id)
+                                              : hook_lookup(HOOK_TYPE_SYSCALL, id);
+        hits += handler != NULL;
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    printf("%s: %llu lookups, %llu hits, %.2f ns/lookup\n",
+           use_aos ? "aos" : "soa", BENCH_LOOKUPS, (unsigned long long)hits,
+           (double)elapsed / BENCH_LOOKUPS);
+
+    free(aos_table);
+    hook_cleanup();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scan.h"
+#include "util.h"
+
+// Runs the scan kernels over a synthetic guest image with every
+// implementation this CPU supports, scalar first as the baseline.
+//
+//   ./scan_bench [image-MiB]
+
+#define BENCH_DEFAULT_IMAGE_MB 256
+#define BENCH_KEYS 512
+#define BENCH_KEY_LOOKUPS 2000000
+
+static const uint8_t signature[] = { 0x1f, 0x20, 0x03, 0xd5, 0xfd, 0x7b, 0xbf, 0xa9 };
+static const uint8_t signature_mask[] = { 0xff, 0xff, 0x00, 0xff, 0xff, 0x00, 0xff, 0xff };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *what, uint64_t bytes, uint64_t elapsed_ns) {
+    printf("  %-10s %8.2f ms  %8.2f GB/s\n", what, elapsed_ns / 1e6,
+           elapsed_ns ? (double)bytes / elapsed_ns : 0.0);
+}
+
+int main(int argc, char **argv) {
+    size_t image_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_DEFAULT_IMAGE_MB;
+    size_t size = image_mb * 1024 * 1024;
+
+    uint8_t *image = malloc(size);
+    uint64_t *keys = malloc(BENCH_KEYS * sizeof(uint64_t));
+    if (!image || !keys || size < sizeof(signature)) {
+        free(image);
+        free(keys);
+        return EXIT_FAILURE;
+    }
+
+    // Code-like noise that never contains the anchor byte 0x1f, with the
+    // signature planted at the very end so every scan walks the image.
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        uint8_t byte = (uint8_t)state;
+        image[i] = byte == 0x1f ? 0x20 : byte;
+    }
+    memcpy(image + size - sizeof(signature), signature, sizeof(signature));
+
+    for (int i = 0; i < BENCH_KEYS; i++) {
+        keys[i] = (uint64_t)i * 7;
+    }
+
+    const scan_impl_t impls[] = { SCAN_IMPL_SCALAR, SCAN_IMPL_SSE42, SCAN_IMPL_AVX2, SCAN_IMPL_NEON };
+
+    for (size_t n = 0; n < sizeof(impls) / sizeof(impls[0]); n++) {
+        if (!scan_impl_supported(impls[n]) || scan_init(impls[n]) != 0) {
+            continue;
+        }
+        printf("%s (%zu MiB image)\n", scan_impl_name(), image_mb);
+
+        uint64_t start = now_ns();
+        const void *hit = scan_memchr(image, size, 0x1f);
+        report("memchr", size, now_ns() - start);
+
+        start = now_ns();
+        const void *found = scan_memmem(image, size, signature, sizeof(signature));
+        report("memmem", size, now_ns() - start);
+
+        start = now_ns();
+        const void *masked = scan_pattern(image, size, signature, signature_mask, sizeof(signature));
+        report("pattern", size, now_ns() - start);
+
+        if (hit != found || found != masked || !found) {
+            printf("  mismatch: scan results disagree\n");
+        }
+
+        uint64_t hits = 0;
+        start = now_ns();
+        for (uint64_t i = 0; i < BENCH_KEY_LOOKUPS; i++) {
+            hits += scan_find_u64(keys, BENCH_KEYS, (i % BENCH_KEYS) * 7) != SCAN_NOT_FOUND;
+        }
+        uint64_t elapsed = now_ns() - start;
+        printf("  %-10s %8.2f ns/lookup (%llu hits)\n", "keys",
+               (double)elapsed / BENCH_KEY_LOOKUPS, (unsigned long long)hits);
+    }
+
+    free(keys);
+    free(image);
+    return EXIT_SUCCESS;
+}
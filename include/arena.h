@@ -0,0 +1,56 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk arena_chunk_t;
+
+// Bump allocator. Chunks are kept across resets, so once an arena has
+// grown to its working-set size it stops calling malloc altogether.
+typedef struct arena {
+    arena_chunk_t *chunks;
+    arena_chunk_t *current;
+    uint8_t *cursor;
+    uint8_t *end;
+    size_t chunk_size;
+} arena_t;
+
+typedef struct {
+    arena_chunk_t *chunk;
+    uint8_t *cursor;
+} arena_mark_t;
+
+int arena_init(arena_t *arena, size_t chunk_size);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+arena_mark_t arena_mark(arena_t *arena);
+void arena_release(arena_t *arena, arena_mark_t mark);
+void arena_destroy(arena_t *arena);
+
+// Per-thread scratch arena, created on first use and freed at thread exit.
+arena_t *arena_thread_scratch(void);
+
+// Fixed-size object cache with an intrusive free list. Not thread-safe;
+// callers serialize access with their own lock.
+typedef struct slab_page slab_page_t;
+
+typedef struct {
+    size_t object_size;
+    size_t align;
+    size_t objects_per_page;
+    slab_page_t *pages;
+    void *free_list;
+    size_t in_use;
+    size_t capacity;
+} slab_t;
+
+int slab_init(slab_t *slab, size_t object_size, size_t align, size_t prealloc);
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *object);
+void slab_destroy(slab_t *slab);
+
+#endif // ARENA_H
@@ -0,0 +1,15 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// Worst-case output size of compress_block() for len input bytes.
+#define COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+// LZ4 block format. Returns the compressed size, or 0 when the output
+// would not fit in capacity.
+size_t compress_block(const void *src, size_t len, void *dst, size_t capacity);
+// Returns the decompressed size, or -1 on malformed input or overflow.
+long decompress_block(const void *src, size_t len, void *dst, size_t capacity);
+
+#endif // COMPRESS_H
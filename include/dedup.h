@@ -0,0 +1,49 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint32_t pages_per_round;   // pages hashed per scan round
+    uint32_t round_interval_ms; // pause between rounds
+} dedup_config_t;
+
+typedef struct {
+    uint64_t pages_scanned;
+    uint64_t pages_shared;      // guest pages currently mapped to a shared frame
+    uint64_t frames;            // distinct shared frames backing them
+    uint64_t bytes_saved;
+    uint64_t merges;
+    uint64_t cow_breaks;
+    uint64_t zero_pages;        // zero pages handed back to the host
+} dedup_stats_t;
+
+// Starts the background scanner over a page-aligned, mmap'd guest region.
+// Identical pages are remapped read-only onto shared memfd frames, up to a
+// budget below vm.max_map_count; zero pages are simply dropped.
+int dedup_start(void *base, size_t size, const dedup_config_t *config);
+// Stops the scanner and drops all frames; the region must be unmapped or
+// rewritten by the caller afterwards.
+void dedup_stop(void);
+
+// Write-fault path: if addr lies on a shared page, gives the guest a
+// private copy again and returns 1. Also returns 1 for a page the scanner
+// had only frozen for a compare, since it is writable again by now.
+// Returns 0 when the page isn't ours.
+int dedup_handle_write_fault(void *addr);
+
+// Keeps pages in [addr, addr + len) private and out of the scan until the
+// matching dedup_unpin(), for hypervisor threads writing guest memory
+// directly. Pins nest.
+int dedup_pin(void *addr, size_t len);
+void dedup_unpin(void *addr, size_t len);
+
+// Takes pages in [addr, addr + len) out of (or back into) the scan. Shared
+// pages are given private copies first, so once this returns the caller
+// may reprotect or replace the range.
+int dedup_set_excluded(void *addr, size_t len, int excluded);
+
+void dedup_get_stats(dedup_stats_t *stats);
+
+#endif // DEDUP_H
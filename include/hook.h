@@ -1,9 +1,62 @@
 #ifndef HOOK_H
 #define HOOK_H
 
+#include <stdint.h>
 #include "trap.h"
 
+#define MAX_SYSCALL_HANDLERS 512
+#define MAX_MEMORY_HANDLERS 128
+#define MAX_EXCEPTION_HANDLERS 64
+#define HOOK_LATENCY_BUCKETS 16   // bucket i: [2^(i+7), 2^(i+8)) ns; first and last open-ended
+
+typedef enum {
+    HOOK_TYPE_SYSCALL,
+    HOOK_TYPE_MEMORY,
+    HOOK_TYPE_EXCEPTION
+} hook_type_t;
+
+typedef int (*hook_handler_func_t)(const trap_event_t *event);
+
+// Per-hook handler latency, only collected while hook_set_timing() is on.
+// Updated with relaxed atomics. Each hook's stats start on their own cache
+// line (152 bytes, padded to three lines) so hooks don't share lines.
+typedef struct {
+    _Alignas(64) uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HOOK_LATENCY_BUCKETS];
+} hook_stats_t;
+
+// Cold per-hook metadata. Lookups never touch it; they scan the packed key
+// arrays in hook.c and only index the handler array on a hit.
+typedef struct {
+    hook_type_t type;
+    uint64_t id;
+    uint64_t region_start;
+    uint64_t region_end;
+    hook_handler_func_t handler;
+    char *lib_path;   // set for dynamic hooks only, so they can be re-resolved
+    char *symbol;     // after a snapshot restore
+    const hook_stats_t *stats;
+} hook_handler_t;
+
+typedef int (*hook_visit_func_t)(const hook_handler_t *hook, void *arg);
+
 int hook_init(void);
+int register_hook(hook_type_t type, uint64_t id,
+                  uint64_t region_start, uint64_t region_end,
+                  hook_handler_func_t handler);
+int register_dynamic_hook(const char *lib_path, const char *func_name, hook_type_t type,
+                          uint64_t id, uint64_t region_start, uint64_t region_end);
+// key is the syscall number / exception code, or the faulting address for
+// memory hooks. Returns NULL when nothing matches.
+hook_handler_func_t hook_lookup(hook_type_t type, uint64_t key);
+// Visits every registered hook in registration order. Stops and returns the
+// visitor's result as soon as it is non-zero.
+int hook_for_each(hook_visit_func_t visit, void *arg);
+// Times every handler call from now on (or stops). Off by default, so the
+// dispatch path costs one predictable branch unless someone is watching.
+void hook_set_timing(int enabled);
 int handle_syscall(const trap_event_t *event);
 int handle_memory_access(const trap_event_t *event);
 int handle_exception(const trap_event_t *event);
@@ -10,6 +10,9 @@ typedef enum {
     HYPERCALL_MAP_MEMORY = 3,    
     HYPERCALL_UNMAP_MEMORY = 4, 
     HYPERCALL_REGISTER_IRQ = 5,  
+    HYPERCALL_SET_TIMER = 6,
+    HYPERCALL_SET_COMPLETION = 7,
+    HYPERCALL_MAP_BATCH = 8,     // arg1 guest array of memmap_range_t, arg2 count
     MAX_HYPERCALL
 } hypercall_nr_t;
 
@@ -21,10 +24,38 @@ typedef struct {
     uint64_t ret;     
 } hypercall_regs_t;
 
+// handle_hypercall() result for a call that will finish on a trap worker.
+// regs->ret then holds a ticket, and the result is reported through the
+// calling vCPU's completion channel (HYPERCALL_SET_COMPLETION: arg1 guest
+// address of a ring of hypercall_completion_t, arg2 entry count, arg3 IRQ
+// to raise, or HYPERCALL_NO_IRQ to poll).
+#define HYPERCALL_PENDING 1
+#define HYPERCALL_NO_IRQ UINT64_MAX
+#define HYPERCALL_ASYNC_MAP_SIZE (16ull * 1024 * 1024)
+#define HYPERCALL_ASYNC_MAP_BATCH 64
+
+// Completion ring entry. Entry (ticket - 1) % entries is written with ret
+// first and ticket last; the guest zeroes ticket once it has consumed it.
+typedef struct {
+    uint64_t ticket;
+    int64_t ret;
+} hypercall_completion_t;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t async_calls;
+    uint64_t failures;
+    uint64_t total_ns;     // entry to result, including time spent queued
+    uint64_t max_ns;
+} hypercall_stats_t;
+
 int hypercall_init(void);
 
+// Returns 0 or -1 for calls handled inline, HYPERCALL_PENDING otherwise.
 int handle_hypercall(hypercall_regs_t *regs);
 
+void hypercall_get_stats(uint64_t nr, hypercall_stats_t *stats);
+
 void hypercall_cleanup(void);
 
 #endif // HYPERCALL_H
@@ -0,0 +1,36 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+
+#define IRQ_MAX 256
+#define IRQ_ANY_VCPU -1
+
+typedef struct {
+    uint64_t raised;
+    uint64_t coalesced;   // raised while already pending
+    uint64_t doorbells;   // wakeups sent to sleeping vCPUs
+    uint64_t delivered;
+    uint64_t unhandled;   // delivered with no guest handler registered
+} irq_stats_t;
+
+int irq_init(int vcpu_count);
+void irq_cleanup(void);
+
+int irq_register_handler(uint32_t irq, uint64_t guest_handler);
+// Returns the registered guest handler, or 0 when none is set.
+uint64_t irq_get_handler(uint32_t irq);
+
+// Lock-free; safe to call from any thread, including hook and device code.
+int irq_raise(int vcpu_id, uint32_t irq);
+
+// vCPU loop side. irq_prepare_sleep() returns 1 when interrupts are already
+// pending and the vCPU should not block; irq_wake() must follow every
+// sleep attempt.
+int irq_prepare_sleep(int vcpu_id);
+void irq_wake(int vcpu_id);
+int irq_deliver_pending(int vcpu_id);
+
+void irq_get_stats(int vcpu_id, irq_stats_t *stats);
+
+#endif // IRQ_H
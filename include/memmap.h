@@ -0,0 +1,57 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MEMMAP_READ 0x1
+#define MEMMAP_WRITE 0x2
+#define MEMMAP_EXEC 0x4
+#define MEMMAP_FLAGS_MASK 0x7
+#define MEMMAP_MAX_BATCH 1024
+#define MEMMAP_MAX_LISTENERS 8
+
+// One request in a batch; flags == 0 unmaps the range. This is also the
+// guest-visible entry layout of HYPERCALL_MAP_BATCH.
+typedef struct {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t flags;
+    uint32_t reserved;
+} memmap_range_t;
+
+typedef struct {
+    uint64_t batches;
+    uint64_t requests;
+    uint64_t host_calls;     // mmap/mprotect calls actually issued
+    uint64_t invalidations;
+    uint64_t ranges;         // current entries in the map
+} memmap_stats_t;
+
+// Called with the lock held after a guest range changes protection, so
+// translation caches can drop anything they derived from it. end is
+// inclusive. Must not call back into memmap.
+typedef void (*memmap_invalidate_func_t)(uint64_t start, uint64_t end, void *arg);
+
+// Tracks [0, size) of the guest region at base, initially mapped with flags.
+int memmap_init(uint8_t *base, uint64_t size, uint32_t flags);
+void memmap_cleanup(void);
+
+// Applies a batch in order (later requests win where they overlap). Host
+// protections change only where the result differs from before, with
+// adjacent changes of the same kind folded into one call.
+int memmap_apply(const memmap_range_t *requests, size_t count);
+
+// Fills range with the maximal mapping containing addr (flags == 0 for a
+// hole). Returns -1 when addr is outside guest memory.
+int memmap_lookup(uint64_t addr, memmap_range_t *range);
+
+// Returns 0 with the map held stable when all of [addr, addr + len) is
+// mapped with at least flags; memmap_release() drops the hold.
+int memmap_acquire(uint64_t addr, uint64_t len, uint32_t flags);
+void memmap_release(void);
+
+int memmap_add_invalidate_listener(memmap_invalidate_func_t fn, void *arg);
+void memmap_get_stats(memmap_stats_t *stats);
+
+#endif // MEMMAP_H
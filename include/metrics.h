@@ -0,0 +1,111 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "trap.h"
+#include "thread_pool.h"
+
+// Shared-memory export for out-of-process readers (ghostvisor-top). The
+// segment is a POSIX shm object named METRICS_SHM_PREFIX<pid> unless a
+// name is given. Everything but the event ring is written by a single
+// publisher under the seqlock in the header; readers retry while seq is
+// odd or changed across their copy.
+#define METRICS_MAGIC 0x4d545647  // "GVTM"
+#define METRICS_VERSION 1
+#define METRICS_SHM_PREFIX "/ghostvisor-"
+#define METRICS_MAX_HOOKS 64
+#define METRICS_LATENCY_BUCKETS 16
+#define METRICS_MAX_HYPERCALLS 16
+#define METRICS_EVENT_RING_SIZE 1024
+#define METRICS_TRAP_TYPES 3
+#define METRICS_DEFAULT_INTERVAL_MS 250
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;              // of the whole segment, for layout checks
+    int32_t pid;
+    uint32_t interval_ms;
+    uint64_t start_ns;          // CLOCK_MONOTONIC
+    uint64_t seq;
+    uint64_t updated_ns;
+} metrics_header_t;
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t processed;
+    uint64_t dropped;           // shed by the overflow policy, all causes
+    uint64_t tasks;
+    int32_t queue_depth;
+    int32_t spill_depth;
+} metrics_pool_t;
+
+typedef struct {
+    uint32_t type;              // hook_type_t
+    uint32_t reserved;
+    uint64_t id;
+    uint64_t region_start;
+    uint64_t region_end;
+    char symbol[32];            // dynamic hooks only
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[METRICS_LATENCY_BUCKETS];   // same buckets as hook_stats_t
+} metrics_hook_t;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t async_calls;
+    uint64_t failures;
+    uint64_t total_ns;
+    uint64_t max_ns;
+} metrics_hypercall_t;
+
+typedef struct {
+    metrics_pool_t pool;
+    uint64_t dedup_pages_shared;
+    uint64_t dedup_bytes_saved;
+    uint64_t mmio_accesses;
+    uint64_t mmio_cache_hits;
+    uint32_t hook_count;
+    uint32_t reserved;
+    metrics_hook_t hooks[METRICS_MAX_HOOKS];
+    metrics_hypercall_t hypercalls[METRICS_MAX_HYPERCALLS];
+} metrics_snapshot_t;
+
+// Trap ring entry, written in place by whichever thread saw the trap.
+// seq is (index + 1) once the entry is complete and 0 while it is being
+// rewritten; a reader keeps an entry only if seq reads the same before
+// and after copying it.
+typedef struct {
+    uint64_t seq;
+    uint64_t time_ns;
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t address;
+    uint64_t data;
+} metrics_event_t;
+
+typedef struct {
+    metrics_header_t header;
+    metrics_snapshot_t snapshot;
+    // Live counters outside the seqlock, bumped with relaxed atomics.
+    uint64_t traps[METRICS_TRAP_TYPES];
+    uint64_t event_head;        // total events ever written
+    metrics_event_t events[METRICS_EVENT_RING_SIZE];
+} metrics_segment_t;
+
+// Creates and maps the segment (name NULL = METRICS_SHM_PREFIX<pid>) and
+// turns on hook timing. metrics_close() unlinks and unmaps it, so call it
+// only once no thread can trap any more (after trap_cleanup()).
+int metrics_open(const char *name, uint32_t interval_ms);
+void metrics_close(void);
+
+// Refreshes the snapshot if interval_ms has passed since the last one.
+// Single publisher: call it from one thread only.
+void metrics_publish(thread_pool_t *pool);
+
+// Appends a trap to the event ring. A no-op unless the segment is open.
+void metrics_record_trap(const trap_event_t *event);
+
+#endif // METRICS_H
@@ -0,0 +1,83 @@
+#ifndef MMIO_H
+#define MMIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "trap.h"
+#include "memmap.h"
+
+#define MMIO_MAX_DEVICES 64
+#define MMIO_CACHE_SIZE 256   // decoded accesses cached for the fast path
+
+typedef struct mmio_device mmio_device_t;
+
+typedef uint64_t (*mmio_read_func_t)(mmio_device_t *dev, uint64_t offset, unsigned width);
+typedef void (*mmio_write_func_t)(mmio_device_t *dev, uint64_t offset, uint64_t value,
+                                  unsigned width);
+
+// One device register. Accesses anywhere inside [offset, offset + width)
+// are routed to it; a NULL callback makes that direction read-as-zero or
+// write-ignored.
+typedef struct {
+    uint64_t offset;
+    unsigned width;
+    mmio_read_func_t read;
+    mmio_write_func_t write;
+} mmio_register_t;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t unhandled;   // accesses that matched no register and no fallback
+} mmio_device_stats_t;
+
+typedef struct {
+    uint64_t accesses;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t undecoded;   // syndrome missing, so the access couldn't be emulated
+    uint64_t invalidations;
+} mmio_stats_t;
+
+// Owned by the caller and must stay alive until mmio_cleanup(). read and
+// write are optional fallbacks for offsets not covered by regs.
+struct mmio_device {
+    const char *name;
+    uint64_t base;
+    uint64_t size;
+    const mmio_register_t *regs;
+    size_t reg_count;
+    mmio_read_func_t read;
+    mmio_write_func_t write;
+    void *opaque;
+    mmio_device_stats_t stats;
+};
+
+int mmio_init(void);
+void mmio_cleanup(void);
+
+// Also claims [base, base + size) in the memory hook table, so writes in
+// replayed traces still reach the device; live accesses are emulated by
+// mmio_handle_access().
+// The window must not be guest RAM for accesses to fault: vm_start() unmaps
+// every page a device registered before it touches, so keep windows
+// page-aligned. Devices added to a running VM need vm_unmap_memory().
+int mmio_register_device(mmio_device_t *dev);
+
+// Fills ranges with the page-rounded window of each device (flags 0, ready
+// for memmap_apply()) and returns how many there are.
+size_t mmio_device_windows(memmap_range_t *ranges, size_t max, uint64_t page_size);
+
+// Fast path, run by the trap consumer before the faulting vCPU is released.
+// Returns 1 when the access hit a device and was emulated (reads leave
+// their result in event->value), 0 when it isn't MMIO or can't be decoded,
+// -1 on error.
+int mmio_handle_access(trap_event_t *event);
+
+// Drops cached decodes overlapping [start, end]. Call whenever the guest
+// physical layout under a device changes.
+void mmio_invalidate(uint64_t start, uint64_t end);
+
+void mmio_get_stats(mmio_stats_t *stats);
+
+#endif // MMIO_H
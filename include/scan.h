@@ -0,0 +1,38 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCAN_NOT_FOUND ((size_t)-1)
+
+typedef enum {
+    SCAN_IMPL_AUTO,
+    SCAN_IMPL_SCALAR,
+    SCAN_IMPL_SSE42,
+    SCAN_IMPL_AVX2,
+    SCAN_IMPL_NEON
+} scan_impl_t;
+
+// Picks the widest kernel set the CPU supports. Until this runs every call
+// uses the scalar kernels, so it is safe to scan before initialization.
+int scan_init(scan_impl_t impl);
+// 1 if impl is compiled in and this CPU can run it.
+int scan_impl_supported(scan_impl_t impl);
+const char *scan_impl_name(void);
+
+// Index of the first keys[i] == key, or SCAN_NOT_FOUND.
+size_t scan_find_u64(const uint64_t *keys, size_t count, uint64_t key);
+// Index of the first starts[i] <= key <= ends[i], or SCAN_NOT_FOUND.
+size_t scan_find_range(const uint64_t *starts, const uint64_t *ends, size_t count, uint64_t key);
+
+const void *scan_memchr(const void *buf, size_t len, uint8_t byte);
+const void *scan_memmem(const void *haystack, size_t haystack_len,
+                        const void *needle, size_t needle_len);
+// Signature search: only the bits set in each mask byte must match, so 0x00
+// is a wildcard and 0xff an exact byte. A NULL mask behaves like
+// scan_memmem().
+const void *scan_pattern(const void *buf, size_t len, const uint8_t *pattern,
+                         const uint8_t *mask, size_t pattern_len);
+
+#endif // SCAN_H
@@ -0,0 +1,80 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC 0x4e535647  // "GVSN"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_CHUNK_SIZE (64 * 1024)
+#define SNAPSHOT_MAX_WORKERS 16
+
+typedef struct snapshot snapshot_t;
+
+// Returns 1 when the page at offset can be read, 0 when it is unmapped
+// or protected against reads.
+typedef int (*snapshot_readable_func_t)(uint64_t offset, void *arg);
+
+// What the writer captures. memory must stay unchanged (VM paused) until
+// snapshot_write() returns. With a readable callback, pages it rejects are
+// stored as zeroes instead of being touched; without one, all of memory
+// must be readable.
+typedef struct {
+    const uint8_t *memory;
+    uint64_t memory_size;
+    const vm_config_t *config;
+    snapshot_readable_func_t readable;
+    void *readable_arg;
+} snapshot_source_t;
+
+typedef struct {
+    uint64_t chunks;
+    uint64_t zero_chunks;        // skipped entirely
+    uint64_t raw_chunks;         // stored page-aligned, mapped straight from the file
+    uint64_t compressed_chunks;
+    uint64_t hooks;
+    uint64_t hooks_skipped;      // static hooks have no library/symbol to record
+    uint64_t irqs;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t elapsed_ns;
+} snapshot_stats_t;
+
+typedef struct {
+    uint64_t lazy_chunks;        // compressed chunks left for first touch
+    uint64_t faulted;            // filled on demand by a guest or host access
+    uint64_t prefetched;         // filled by the background thread
+} snapshot_restore_stats_t;
+
+// Compresses memory on up to workers threads (0 = one per online CPU) and
+// streams chunks to path in guest address order.
+int snapshot_write(const char *path, const snapshot_source_t *source, int workers,
+                   snapshot_stats_t *stats);
+
+snapshot_t *snapshot_open(const char *path);
+void snapshot_get_config(snapshot_t *snap, vm_config_t *config);
+uint64_t snapshot_memory_size(snapshot_t *snap);
+
+// Populates a freshly mapped, zeroed guest region without reading it all
+// up front: zero chunks are left alone, raw chunks are mmap'd from the
+// snapshot file and compressed chunks are protected until first touch.
+int snapshot_map_memory(snapshot_t *snap, uint8_t *memory, uint64_t size);
+// Re-registers recorded dynamic hooks and guest IRQ handlers.
+int snapshot_restore_registrations(snapshot_t *snap);
+// Decompresses the remaining chunks in the background.
+int snapshot_start_prefetch(snapshot_t *snap);
+
+// Fault path: if addr lies on a chunk that is still compressed, fills it
+// and returns 1. Returns 0 when the address isn't ours.
+int snapshot_fault_in(snapshot_t *snap, void *addr);
+// Fills every pending chunk overlapping [offset, offset + len) so host
+// code can read guest memory directly.
+int snapshot_make_resident(snapshot_t *snap, uint64_t offset, uint64_t len);
+
+void snapshot_get_restore_stats(snapshot_t *snap, snapshot_restore_stats_t *stats);
+// Stops prefetching and releases the file. Chunks not yet filled are lost,
+// so call this only once the guest memory is being torn down.
+void snapshot_close(snapshot_t *snap);
+
+#endif // SNAPSHOT_H
@@ -4,12 +4,66 @@
 #include <stdint.h>
 #include "trap.h"
 
+#define THREAD_POOL_DEFAULT_QUEUE_SIZE 1024
+
 typedef struct thread_pool thread_pool_t;
 
+typedef struct pool_task pool_task_t;
+typedef void (*pool_task_func_t)(pool_task_t *task, void *arg);
+
+// Caller-owned, intrusive work item (set up with pool_task_init()). It must
+// stay valid until fn has started running; fn may free it.
+struct pool_task {
+    pool_task_func_t fn;
+    void *arg;
+    pool_task_t *next;
+};
+
+// What thread_pool_submit does when the work queue is full.
+typedef enum {
+    POOL_OVERFLOW_BLOCK,        // wait for a free slot (previous behaviour)
+    POOL_OVERFLOW_DROP_OLDEST,  // evict the oldest queued event
+    POOL_OVERFLOW_DROP_CLASS,   // drop incoming events whose trap type is in drop_class_mask
+    POOL_OVERFLOW_SAMPLE,       // keep 1 in sample_rate incoming events, evicting the oldest
+    POOL_OVERFLOW_SPILL         // park events in an overflow ring, drop once that fills too
+} pool_overflow_policy_t;
+
+typedef struct {
+    int num_threads;
+    int queue_size;
+    pool_overflow_policy_t policy;
+    uint32_t drop_class_mask;   // bit (1 << trap_type_t) per droppable class
+    uint32_t sample_rate;
+    int spill_size;
+} thread_pool_config_t;
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t processed;
+    uint64_t dropped_oldest;
+    uint64_t dropped_class;
+    uint64_t dropped_sampled;
+    uint64_t spilled;
+    uint64_t dropped_spill;
+    uint64_t tasks;
+    int queue_depth;
+    int spill_depth;
+} thread_pool_stats_t;
+
 thread_pool_t *thread_pool_create(int num_threads);
+thread_pool_t *thread_pool_create_with_config(const thread_pool_config_t *config);
 
+// Returns 0 when the event was queued, 1 when the overflow policy shed it
+// and -1 on error or shutdown.
 int thread_pool_submit(thread_pool_t *pool, trap_event_t *event);
 
+void pool_task_init(pool_task_t *task, pool_task_func_t fn, void *arg);
+// Queues a task to run on a worker ahead of pending trap events. Tasks
+// bypass the overflow policy and are never shed.
+int thread_pool_submit_task(thread_pool_t *pool, pool_task_t *task);
+
+void thread_pool_get_stats(thread_pool_t *pool, thread_pool_stats_t *stats);
+
 void thread_pool_destroy(thread_pool_t *pool);
 
 #endif // THREAD_POOL_H
@@ -0,0 +1,39 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_NS 100000ull  // 100us wheel resolution
+
+typedef struct wheel_timer wheel_timer_t;
+typedef struct timer_wheel timer_wheel_t;
+
+typedef void (*wheel_timer_fn_t)(wheel_timer_t *timer, void *arg);
+
+// Timers are embedded in their owner's structures, so arming and
+// cancelling never allocate. Fields are private to timer.c.
+struct wheel_timer {
+    wheel_timer_t *next;
+    wheel_timer_t *prev;
+    uint64_t expires;
+    wheel_timer_fn_t fn;
+    void *arg;
+    uint8_t level;
+    uint8_t slot;
+    uint8_t armed;
+};
+
+// A wheel is owned by one host thread; none of these calls are thread-safe.
+timer_wheel_t *timer_wheel_create(void);
+void timer_wheel_destroy(timer_wheel_t *wheel);
+int timer_wheel_fd(timer_wheel_t *wheel);
+// Fires every expired timer and reprograms the timerfd. Returns the number fired.
+int timer_wheel_run(timer_wheel_t *wheel);
+
+void timer_init(wheel_timer_t *timer, wheel_timer_fn_t fn, void *arg);
+int timer_arm(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline_ns);
+void timer_cancel(timer_wheel_t *wheel, wheel_timer_t *timer);
+
+uint64_t timer_now_ns(void);
+
+#endif // TIMER_H
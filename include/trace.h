@@ -0,0 +1,41 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "trap.h"
+#include "thread_pool.h"
+
+#define TRACE_MAGIC 0x52545647  // "GVTR"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_WINDOW_SIZE (4 * 1024 * 1024)
+
+typedef struct trace_writer trace_writer_t;
+typedef struct trace_reader trace_reader_t;
+
+typedef enum {
+    TRACE_REPLAY_REALTIME,  // reproduce the recorded inter-event gaps
+    TRACE_REPLAY_FAST       // submit as fast as the pool accepts
+} trace_replay_mode_t;
+
+typedef struct {
+    uint64_t events;
+    uint64_t submitted;
+    uint64_t shed;
+    uint64_t elapsed_ns;
+} trace_replay_stats_t;
+
+trace_writer_t *trace_writer_open(const char *path, size_t window_size);
+int trace_write_event(trace_writer_t *writer, const trap_event_t *event);
+uint64_t trace_writer_event_count(trace_writer_t *writer);
+void trace_writer_close(trace_writer_t *writer);
+
+trace_reader_t *trace_reader_open(const char *path);
+// Returns 0 and fills event/timestamp_ns, 1 at end of trace, -1 on a corrupt record.
+int trace_reader_next(trace_reader_t *reader, trap_event_t *event, uint64_t *timestamp_ns);
+void trace_reader_close(trace_reader_t *reader);
+
+int trace_replay(const char *path, thread_pool_t *pool, trace_replay_mode_t mode,
+                 trace_replay_stats_t *stats);
+
+#endif // TRACE_H
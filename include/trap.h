@@ -9,14 +9,75 @@ typedef enum {
     TRAP_EXCEPTION
 } trap_type_t;
 
+typedef struct arena arena_t;
+
 typedef struct {
     trap_type_t type;
     uint64_t address;
     uint64_t data;
+    uint64_t value;    // memory traps: data being written, or the emulated read result
+    arena_t *scratch;  // per-trap scratch memory, reset once the handler returns
 } trap_event_t;
 
+// Memory trap syndrome carried in data, laid out like the ARM data abort
+// ISS: when TRAP_MEM_ISV is set the access width and direction are known
+// without decoding the faulting instruction.
+#define TRAP_MEM_ISV (1ull << 24)
+#define TRAP_MEM_SAS_SHIFT 22           // log2 of the access size in bytes
+#define TRAP_MEM_SAS_MASK 0x3ull
+#define TRAP_MEM_SRT_SHIFT 16           // guest register being transferred
+#define TRAP_MEM_SRT_MASK 0x1full
+#define TRAP_MEM_WNR (1ull << 6)        // write, not read
+
+typedef struct trace_writer trace_writer_t;
+
+#define TRAP_MAX_VCPUS 64
+#define TRAP_VCPU_QUEUE_SIZE 256
+#define TRAP_SIGNAL_RING_SIZE 64
+#define TRAP_MAX_SIGNAL_RINGS 128
+
+// Resolver results.
+#define TRAP_RESOLVE_NONE 0
+#define TRAP_RESOLVE_RETRY 1        // page fixed up, the access can be retried
+#define TRAP_RESOLVE_EMULATED 2     // access completed (reads leave event->value)
+
+// Fixes up a captured guest memory fault (event->address is a guest
+// offset; on x86 the syndrome is decoded from the faulting instruction for
+// MOV and MOVZX). Returns one of TRAP_RESOLVE_*.
+typedef int (*trap_resolver_t)(trap_event_t *event);
+
+// Installs the SIGSEGV/SIGBUS/SIGILL handler and starts the consumer
+// thread. The handler only touches the faulting thread's signal ring, so it
+// never blocks on a lock; the consumer runs the resolver on guest faults
+// (one it can't fix is fatal) and posts other traps to the faulting
+// thread's vCPU source.
 int trap_init(void);
-int trap_wait_for_event(trap_event_t *event);
+void trap_set_trace_writer(trace_writer_t *writer);
 void trap_cleanup(void);
 
+// Faults inside [base, base + size) are reported as guest offsets and the
+// faulting thread waits for the resolver; other faults are recorded and
+// then take the default action. Clearing the region (NULL) or the resolver
+// waits for a resolver call in progress to return.
+void trap_set_guest_region(void *base, uint64_t size);
+void trap_set_fault_resolver(trap_resolver_t resolver);
+
+// Gives the calling thread a signal ring, owned by vcpu_id (-1 for none).
+// Faults on threads without one are not captured.
+int trap_register_thread(int vcpu_id);
+void trap_unregister_thread(void);
+
+// Per-vCPU event sources. Each source owns an eventfd that becomes readable
+// whenever an event is posted or the vCPU is kicked, so a vCPU loop can
+// poll() it alongside its other descriptors. Unregistering detaches the
+// source at once but frees it only in trap_cleanup().
+int trap_register_vcpu(int vcpu_id);
+void trap_unregister_vcpu(int vcpu_id);
+int trap_vcpu_event_fd(int vcpu_id);
+int trap_post_event(int vcpu_id, const trap_event_t *event);
+// Returns 0 with an event, 1 when the source is empty, -1 on error.
+int trap_pop_vcpu_event(int vcpu_id, trap_event_t *event);
+void trap_ack_vcpu(int vcpu_id);
+void trap_kick_vcpu(int vcpu_id);
+
 #endif // TRAP_H
@@ -1,17 +1,87 @@
 #ifndef VM_H
 #define VM_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include "thread_pool.h"
+#include "timer.h"
+#include "memmap.h"
 
 typedef struct {
     uint64_t memory_size;  
     int cpu_count;         
+    int trap_workers;                       // 0 = one per vCPU
+    int trap_queue_size;                    // 0 = THREAD_POOL_DEFAULT_QUEUE_SIZE
+    pool_overflow_policy_t overflow_policy;
+    uint32_t dedup_pages_per_round;         // 0 = page dedup disabled
+    uint32_t dedup_interval_ms;             // 0 = default scan interval
 } vm_config_t;
 
+// Guest-visible layout, returned by HYPERCALL_QUERY_INFO.
+typedef struct {
+    uint64_t memory_size;
+    uint32_t vcpu_count;
+    uint32_t features;
+} vm_info_t;
+
 int vm_init(void);
 int vm_start(vm_config_t *config);
 int vm_poll(void);
+int vm_pause(void);
+int vm_resume(void);
 void vm_stop(void);
 void vm_cleanup(void);
 
+// Pauses the VM, writes guest memory, configuration and hook/IRQ
+// registrations to path, and resumes it.
+int vm_snapshot(const char *path);
+// Starts a VM from a snapshot instead of vm_start(). Guest memory is
+// restored lazily, so vCPUs run before every chunk has been decompressed.
+int vm_restore(const char *path);
+
+// Searches guest memory for a byte signature (mask bytes of 0x00 are
+// wildcards, NULL mask for an exact match) and stores up to max_matches
+// guest addresses. Returns the number of matches or -1.
+int vm_scan_memory(uint64_t guest_addr, uint64_t len, const uint8_t *pattern,
+                   const uint8_t *mask, size_t pattern_len,
+                   uint64_t *matches, size_t max_matches);
+
+int vm_get_info(vm_info_t *info);
+
+// Copy between host buffers and guest memory. Guest addresses are passed
+// as pointers, the way hypercall arguments carry them.
+int vm_read_memory(const void *guest_src, void *dst, size_t len);
+int vm_write_memory(const void *src, void *guest_dst, size_t len);
+
+// Change how the guest sees [guest_addr, guest_addr + size): MEMMAP_*
+// flags, 0 to unmap. Ranges must be page-aligned. A batch is applied in
+// order with the fewest host remaps that produce the final layout.
+int vm_map_memory(uint64_t guest_addr, uint64_t size, uint32_t flags);
+int vm_unmap_memory(uint64_t guest_addr, uint64_t size);
+int vm_map_batch(const memmap_range_t *ranges, size_t count);
+
+// Runs task on a trap worker; used to finish long-running requests off
+// the vCPU.
+int vm_submit_task(pool_task_t *task);
+
+int vm_register_irq_handler(uint32_t irq, uint64_t handler);
+// Posts irq to vcpu_id (or IRQ_ANY_VCPU) without taking locks.
+int vm_raise_irq(int vcpu_id, uint32_t irq);
+
+// Timers live on vcpu_id's wheel (VM_CALLING_VCPU for the calling vCPU
+// thread). On that vCPU the change is made at once; from any other thread,
+// such as a pool worker running a memory or syscall hook, it is queued and
+// made when the vCPU next wakes, so a cancel can't stop a callback already
+// due. Callback timers are owned by the caller, set up with timer_init(),
+// and must stay alive until they fire or the cancel has been made.
+#define VM_CALLING_VCPU (-1)
+int vm_arm_guest_timer(int vcpu_id, uint32_t timer_id, uint32_t irq,
+                       uint64_t delay_ns, uint64_t period_ns);
+int vm_cancel_guest_timer(int vcpu_id, uint32_t timer_id);
+int vm_schedule_callback(int vcpu_id, wheel_timer_t *timer, uint64_t delay_ns);
+void vm_cancel_callback(int vcpu_id, wheel_timer_t *timer);
+
+// vCPU id of the calling thread, or -1 outside a vCPU loop.
+int vm_current_vcpu(void);
+
 #endif // VM_H
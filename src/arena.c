@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+#include "util.h"
+
+#define SLAB_DEFAULT_OBJECTS 64
+
+struct arena_chunk {
+    arena_chunk_t *next;
+    size_t size;
+    uint8_t *data;
+};
+
+struct slab_page {
+    slab_page_t *next;
+    uint8_t *objects;
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static _Thread_local arena_t *thread_scratch = NULL;
+
+static size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static arena_chunk_t *arena_chunk_create(size_t size) {
+    size_t header = align_up(sizeof(arena_chunk_t), ARENA_ALIGN);
+    arena_chunk_t *chunk = malloc(header + size);
+    if (!chunk) return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->data = (uint8_t *)chunk + header;
+    return chunk;
+}
+
+static void arena_use_chunk(arena_t *arena, arena_chunk_t *chunk) {
+    arena->current = chunk;
+    arena->cursor = chunk->data;
+    arena->end = chunk->data + chunk->size;
+}
+
+int arena_init(arena_t *arena, size_t chunk_size) {
+    if (!arena) return -1;
+
+    memset(arena, 0, sizeof(*arena));
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+
+    arena_chunk_t *chunk = arena_chunk_create(arena->chunk_size);
+    if (!chunk) {
+        log_error("Failed to allocate arena chunk");
+        return -1;
+    }
+
+    arena->chunks = chunk;
+    arena_use_chunk(arena, chunk);
+    return 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size) {
+    if (!arena || !arena->current) return NULL;
+
+    size = align_up(size ? size : 1, ARENA_ALIGN);
+    if ((size_t)(arena->end - arena->cursor) >= size) {
+        void *ptr = arena->cursor;
+        arena->cursor += size;
+        return ptr;
+    }
+
+    // Move on to a retained chunk if one is big enough, otherwise grow.
+    arena_chunk_t *chunk = arena->current->next;
+    while (chunk && chunk->size < size) {
+        chunk = chunk->next;
+    }
+
+    if (!chunk) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk = arena_chunk_create(chunk_size);
+        if (!chunk) {
+            log_error("Failed to grow arena by %zu bytes", chunk_size);
+            return NULL;
+        }
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    } else if (chunk != arena->current->next) {
+        // Keep the chain ordered by use so reset/reuse walks stay short.
+        arena_chunk_t *prev = arena->current->next;
+        while (prev->next != chunk) {
+            prev = prev->next;
+        }
+        prev->next = chunk->next;
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    }
+
+    arena_use_chunk(arena, chunk);
+    void *ptr = arena->cursor;
+    arena->cursor += size;
+    return ptr;
+}
+
+void arena_reset(arena_t *arena) {
+    if (!arena || !arena->chunks) return;
+    arena_use_chunk(arena, arena->chunks);
+}
+
+arena_mark_t arena_mark(arena_t *arena) {
+    arena_mark_t mark = { arena->current, arena->cursor };
+    return mark;
+}
+
+void arena_release(arena_t *arena, arena_mark_t mark) {
+    if (!arena || !mark.chunk) return;
+
+    arena->current = mark.chunk;
+    arena->cursor = mark.cursor;
+    arena->end = mark.chunk->data + mark.chunk->size;
+}
+
+void arena_destroy(arena_t *arena) {
+    if (!arena) return;
+
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+static void scratch_destructor(void *ptr) {
+    arena_t *arena = ptr;
+    arena_destroy(arena);
+    free(arena);
+}
+
+static void scratch_key_create(void) {
+    pthread_key_create(&scratch_key, scratch_destructor);
+}
+
+arena_t *arena_thread_scratch(void) {
+    if (thread_scratch) return thread_scratch;
+
+    pthread_once(&scratch_once, scratch_key_create);
+
+    arena_t *arena = malloc(sizeof(arena_t));
+    if (!arena) return NULL;
+
+    if (arena_init(arena, ARENA_DEFAULT_CHUNK_SIZE) != 0) {
+        free(arena);
+        return NULL;
+    }
+
+    pthread_setspecific(scratch_key, arena);
+    thread_scratch = arena;
+    return arena;
+}
+
+static int slab_grow(slab_t *slab) {
+    size_t header = align_up(sizeof(slab_page_t), slab->align);
+    slab_page_t *page = aligned_alloc(slab->align,
+                                      align_up(header + slab->objects_per_page * slab->object_size,
+                                               slab->align));
+    if (!page) {
+        log_error("Failed to grow slab of %zu-byte objects", slab->object_size);
+        return -1;
+    }
+
+    page->objects = (uint8_t *)page + header;
+    page->next = slab->pages;
+    slab->pages = page;
+
+    for (size_t i = 0; i < slab->objects_per_page; i++) {
+        void **object = (void **)(page->objects + i * slab->object_size);
+        *object = slab->free_list;
+        slab->free_list = object;
+    }
+
+    slab->capacity += slab->objects_per_page;
+    return 0;
+}
+
+int slab_init(slab_t *slab, size_t object_size, size_t align, size_t prealloc) {
+    if (!slab || object_size == 0) return -1;
+
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    if (align & (align - 1)) {
+        log_error("Slab alignment must be a power of two: %zu", align);
+        return -1;
+    }
+
+    memset(slab, 0, sizeof(*slab));
+    slab->align = align;
+    slab->object_size = align_up(object_size < sizeof(void *) ? sizeof(void *) : object_size, align);
+    slab->objects_per_page = prealloc ? prealloc : SLAB_DEFAULT_OBJECTS;
+
+    return slab_grow(slab);
+}
+
+void *slab_alloc(slab_t *slab) {
+    if (!slab->free_list && slab_grow(slab) != 0) {
+        return NULL;
+    }
+
+    void **object = slab->free_list;
+    slab->free_list = *object;
+    slab->in_use++;
+    return object;
+}
+
+void slab_free(slab_t *slab, void *object) {
+    if (!object) return;
+
+    void **entry = object;
+    *entry = slab->free_list;
+    slab->free_list = entry;
+    slab->in_use--;
+}
+
+void slab_destroy(slab_t *slab) {
+    if (!slab) return;
+
+    if (slab->in_use) {
+        log_warn("Destroying slab with %zu objects still in use", slab->in_use);
+    }
+
+    slab_page_t *page = slab->pages;
+    while (page) {
+        slab_page_t *next = page->next;
+        free(page);
+        page = next;
+    }
+    memset(slab, 0, sizeof(*slab));
+}
@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <string.h>
+#include "compress.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_LOG 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5     // the format requires trailing literals
+#define LZ_MF_LIMIT 12         // no match may start this close to the end
+#define LZ_SKIP_TRIGGER 6
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static uint8_t *lz_write_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *lz_emit(uint8_t *op, const uint8_t *oend, const uint8_t *literals,
+                        size_t literal_len, size_t offset, size_t match_len, int last) {
+    if (op >= oend) return NULL;
+
+    uint8_t *token = op++;
+    *token = (uint8_t)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15 && !(op = lz_write_length(op, oend, literal_len - 15))) {
+        return NULL;
+    }
+
+    if ((size_t)(oend - op) < literal_len) return NULL;
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+
+    if (last) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    size_t code = match_len - LZ_MIN_MATCH;
+    *token |= (uint8_t)(code >= 15 ? 15 : code);
+    if (code >= 15) {
+        op = lz_write_length(op, oend, code - 15);
+    }
+    return op;
+}
+
+size_t compress_block(const void *src, size_t len, void *dst, size_t capacity) {
+    const uint8_t *base = src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend = base + len;
+    uint8_t *op = dst;
+    const uint8_t *oend = op + capacity;
+    uint32_t table[1 << LZ_HASH_LOG];
+
+    if (len > LZ_MF_LIMIT) {
+        const uint8_t *mflimit = iend - LZ_MF_LIMIT;
+        const uint8_t *matchlimit = iend - LZ_LAST_LITERALS;
+        unsigned attempts = 1u << LZ_SKIP_TRIGGER;
+
+        memset(table, 0, sizeof(table));
+
+        while (ip < mflimit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = lz_hash(sequence);
+            const uint8_t *ref = base + table[h];
+            table[h] = (uint32_t)(ip - base);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != sequence) {
+                // Step further the longer we go without a match, so
+                // incompressible data is skipped quickly.
+                ip += attempts++ >> LZ_SKIP_TRIGGER;
+                continue;
+            }
+
+            const uint8_t *mp = ip + LZ_MIN_MATCH;
+            const uint8_t *rp = ref + LZ_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = lz_emit(op, oend, anchor, ip - anchor, ip - ref, mp - ip, 0);
+            if (!op) return 0;
+
+            ip = mp;
+            anchor = ip;
+            attempts = 1u << LZ_SKIP_TRIGGER;
+        }
+    }
+
+    op = lz_emit(op, oend, anchor, iend - anchor, 0, 0, 1);
+    if (!op) return 0;
+    return op - (uint8_t *)dst;
+}
+
+long decompress_block(const void *src, size_t len, void *dst, size_t capacity) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + capacity;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) return -1;
+                byte = *ip++;
+                literal_len += byte;
+            } while (byte == 255);
+        }
+
+        if ((size_t)(iend - ip) < literal_len || (size_t)(oend - op) < literal_len) return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+
+        if (ip == iend) break;  // final sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            uint8_t byte;
+            do {
+                if (ip >= iend) return -1;
+                byte = *ip++;
+                match_len += byte;
+            } while (byte == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if ((size_t)(oend - op) < match_len) return -1;
+        const uint8_t *match = op - offset;
+        // Overlapping copies are how runs are encoded; copy bytewise.
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+
+    return op - (uint8_t *)dst;
+}
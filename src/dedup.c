@@ -0,0 +1,632 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "dedup.h"
+#include "util.h"
+
+#define DEDUP_NO_FRAME UINT32_MAX
+#define DEDUP_NO_PAGE UINT32_MAX
+#define DEDUP_PROBE_LIMIT 16
+#define DEDUP_HASH_SEED 0x9e3779b97f4a7c15ull
+#define DEDUP_DEFAULT_MAX_MAP_COUNT 65530
+// Each shared page is a mapping of its own and can split the guest's
+// anonymous mapping around it, so it may cost two entries against
+// vm.max_map_count. Sharing stops at a quarter of the limit, leaving the
+// rest to the guest's own mappings and everything else in the process.
+#define DEDUP_MAP_BUDGET_DIVISOR 4
+
+// Maps a content checksum to either a shared frame or, before a second
+// page with the same content shows up, the single candidate page seen so
+// far (the same two-step approach KSM uses to avoid copying unique pages).
+typedef struct {
+    uint64_t checksum;
+    uint32_t frame;
+    uint32_t candidate;
+    int used;
+} dedup_entry_t;
+
+typedef struct {
+    int running;
+    uint8_t *base;
+    size_t size;
+    size_t page_size;
+    uint32_t page_count;
+    dedup_config_t config;
+
+    // Per guest page: frame index or DEDUP_NO_FRAME, and the checksum from
+    // the previous pass. A page is only merged once it has stayed stable
+    // for a full pass, which keeps hot pages from bouncing.
+    uint32_t *page_frame;
+    uint64_t *page_checksum;
+    // Pages the guest has mapped with anything but read/write. The scanner
+    // never touches them, since freezing and thawing would undo the guest's
+    // protection.
+    uint8_t *page_excluded;
+    // Pages the hypervisor is writing through its own mapping right now
+    // (vm_write_memory()). Those writers have no fault capture, so the
+    // scanner must not freeze the page under them.
+    uint32_t *page_pins;
+    // Zero pages already handed back to the host, so the next pass doesn't
+    // release them again; cleared once the content changes.
+    uint8_t *page_released;
+
+    // Frames live in a sparse memfd sized for the whole region; freed
+    // frames are hole-punched and reused from a free stack.
+    int memfd;
+    uint8_t *frames;
+    uint32_t *frame_refs;
+    uint64_t *frame_checksum;
+    uint32_t *free_frames;
+    uint32_t free_count;
+    uint32_t next_frame;
+
+    dedup_entry_t *table;
+    size_t table_mask;
+
+    uint64_t zero_checksum;
+    uint64_t max_shared;        // shared-page budget from vm.max_map_count
+    int budget_logged;
+
+    uint32_t cursor;
+    dedup_stats_t stats;
+
+    // Held across remaps and full-page compares; the write-fault path runs
+    // on the trap consumer thread, which may block.
+    pthread_mutex_t lock;
+    pthread_t thread;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t sleep_cond;
+} dedup_state_t;
+
+static dedup_state_t dedup = { .lock = PTHREAD_MUTEX_INITIALIZER, .memfd = -1 };
+
+static void dedup_lock(void) {
+    pthread_mutex_lock(&dedup.lock);
+}
+
+static void dedup_unlock(void) {
+    pthread_mutex_unlock(&dedup.lock);
+}
+
+static int dedup_page_skipped(uint32_t page) {
+    return dedup.page_excluded[page] || dedup.page_pins[page];
+}
+
+static uint64_t dedup_checksum(const uint8_t *page, size_t size) {
+    const uint64_t *words = (const uint64_t *)page;
+    uint64_t h = DEDUP_HASH_SEED;
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+        h ^= words[i];
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static uint8_t *dedup_page(uint32_t page) {
+    return dedup.base + (size_t)page * dedup.page_size;
+}
+
+static int dedup_page_is_zero(uint32_t page) {
+    const uint64_t *words = (const uint64_t *)dedup_page(page);
+    for (size_t i = 0; i < dedup.page_size / sizeof(uint64_t); i++) {
+        if (words[i]) return 0;
+    }
+    return 1;
+}
+
+static uint8_t *dedup_frame(uint32_t frame) {
+    return dedup.frames + (size_t)frame * dedup.page_size;
+}
+
+static dedup_entry_t *dedup_lookup(uint64_t checksum, int insert) {
+    dedup_entry_t *victim = NULL;
+
+    for (size_t probe = 0; probe < DEDUP_PROBE_LIMIT; probe++) {
+        dedup_entry_t *entry = &dedup.table[(checksum + probe) & dedup.table_mask];
+        if (entry->used && entry->checksum == checksum) {
+            return entry;
+        }
+        if (!insert) continue;
+        if (!entry->used) {
+            victim = victim ? victim : entry;
+            break;
+        }
+        // Candidate-only entries are cheap to lose; shared frames are not.
+        if (!victim && entry->frame == DEDUP_NO_FRAME) {
+            victim = entry;
+        }
+    }
+
+    if (victim) {
+        victim->used = 1;
+        victim->checksum = checksum;
+        victim->frame = DEDUP_NO_FRAME;
+        victim->candidate = DEDUP_NO_PAGE;
+    }
+    return victim;
+}
+
+static uint32_t dedup_alloc_frame(void) {
+    if (dedup.free_count) {
+        return dedup.free_frames[--dedup.free_count];
+    }
+    if (dedup.next_frame < dedup.page_count) {
+        return dedup.next_frame++;
+    }
+    return DEDUP_NO_FRAME;
+}
+
+static void dedup_release_frame(uint32_t frame) {
+    dedup_entry_t *entry = dedup_lookup(dedup.frame_checksum[frame], 0);
+    if (entry && entry->frame == frame) {
+        entry->frame = DEDUP_NO_FRAME;
+    }
+
+    if (fallocate(dedup.memfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  (off_t)frame * dedup.page_size, dedup.page_size) != 0) {
+        log_warn("Failed to release dedup frame %u: %s", frame, strerror(errno));
+    }
+    dedup.free_frames[dedup.free_count++] = frame;
+    dedup.stats.frames--;
+}
+
+static int dedup_map_shared(uint32_t page, uint32_t frame) {
+    void *addr = mmap(dedup_page(page), dedup.page_size, PROT_READ,
+                      MAP_SHARED | MAP_FIXED, dedup.memfd, (off_t)frame * dedup.page_size);
+    if (addr == MAP_FAILED) {
+        log_error("Failed to map guest page onto shared frame: %s", strerror(errno));
+        return -1;
+    }
+
+    dedup.page_frame[page] = frame;
+    dedup.frame_refs[frame]++;
+    dedup.stats.pages_shared++;
+    dedup.stats.merges++;
+    return 0;
+}
+
+// Read-only while we compare so the guest can't change a page between the
+// memcmp and the remap. A guest write in that window faults; the resolver
+// waits on the lock and then has the access retried.
+static int dedup_freeze(uint32_t page) {
+    return mprotect(dedup_page(page), dedup.page_size, PROT_READ);
+}
+
+static void dedup_thaw(uint32_t page) {
+    mprotect(dedup_page(page), dedup.page_size, PROT_READ | PROT_WRITE);
+}
+
+// Zero pages need no frame: dropping the private copy leaves the guest's
+// own mapping in place, and the kernel maps its zero page on the next read.
+// Frozen meanwhile, like a merge, so a racing write is retried after us.
+static void dedup_release_zero_page(uint32_t page) {
+    if (dedup_freeze(page) != 0) {
+        return;
+    }
+    if (dedup_page_is_zero(page) &&
+        madvise(dedup_page(page), dedup.page_size, MADV_DONTNEED) == 0) {
+        dedup.page_released[page] = 1;
+        dedup.stats.zero_pages++;
+    }
+    dedup_thaw(page);
+}
+
+// Only called before adding a shared mapping.
+static int dedup_within_budget(void) {
+    if (dedup.stats.pages_shared < dedup.max_shared) {
+        return 1;
+    }
+    if (!dedup.budget_logged) {
+        log_warn("Dedup stopped sharing at %llu pages to stay below vm.max_map_count.",
+                 (unsigned long long)dedup.stats.pages_shared);
+        dedup.budget_logged = 1;
+    }
+    return 0;
+}
+
+static void dedup_scan_page(uint32_t page) {
+    // Checksummed under the lock: outside it an excluded page may be
+    // unmapped or reprotected at any moment.
+    dedup_lock();
+
+    if (dedup_page_skipped(page) || dedup.page_frame[page] != DEDUP_NO_FRAME) {
+        dedup_unlock();
+        return;
+    }
+
+    uint64_t checksum = dedup_checksum(dedup_page(page), dedup.page_size);
+    dedup.stats.pages_scanned++;
+
+    if (checksum != dedup.page_checksum[page]) {
+        dedup.page_checksum[page] = checksum;
+        dedup.page_released[page] = 0;
+        dedup_unlock();
+        return;
+    }
+
+    if (checksum == dedup.zero_checksum) {
+        if (!dedup.page_released[page]) {
+            dedup_release_zero_page(page);
+        }
+        dedup_unlock();
+        return;
+    }
+
+    if (!dedup_within_budget()) {
+        dedup_unlock();
+        return;
+    }
+
+    dedup_entry_t *entry = dedup_lookup(checksum, 1);
+    if (!entry) {
+        dedup_unlock();
+        return;
+    }
+
+    if (entry->frame != DEDUP_NO_FRAME) {
+        if (dedup_freeze(page) == 0) {
+            if (memcmp(dedup_page(page), dedup_frame(entry->frame), dedup.page_size) != 0 ||
+                dedup_map_shared(page, entry->frame) != 0) {
+                dedup_thaw(page);
+            }
+        }
+    } else if (entry->candidate != DEDUP_NO_PAGE && entry->candidate != page &&
+               dedup.page_frame[entry->candidate] == DEDUP_NO_FRAME &&
+               !dedup_page_skipped(entry->candidate)) {
+        uint32_t other = entry->candidate;
+        uint32_t frame = dedup_alloc_frame();
+
+        if (frame != DEDUP_NO_FRAME && dedup_freeze(page) == 0 && dedup_freeze(other) == 0 &&
+            memcmp(dedup_page(page), dedup_page(other), dedup.page_size) == 0) {
+            memcpy(dedup_frame(frame), dedup_page(page), dedup.page_size);
+            dedup.frame_checksum[frame] = checksum;
+            dedup.frame_refs[frame] = 0;
+            dedup.stats.frames++;
+            entry->frame = frame;
+            entry->candidate = DEDUP_NO_PAGE;
+
+            if (dedup_map_shared(page, frame) != 0) dedup_thaw(page);
+            if (dedup_map_shared(other, frame) != 0) dedup_thaw(other);
+            if (dedup.frame_refs[frame] == 0) dedup_release_frame(frame);
+        } else {
+            dedup_thaw(page);
+            dedup_thaw(other);
+            if (frame != DEDUP_NO_FRAME) {
+                dedup.free_frames[dedup.free_count++] = frame;
+            }
+            entry->candidate = page;
+        }
+    } else {
+        entry->candidate = page;
+    }
+
+    dedup_unlock();
+}
+
+static void *dedup_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&dedup.sleep_lock);
+    while (dedup.running) {
+        pthread_mutex_unlock(&dedup.sleep_lock);
+
+        for (uint32_t n = 0; n < dedup.config.pages_per_round; n++) {
+            dedup_scan_page(dedup.cursor);
+            dedup.cursor = (dedup.cursor + 1) % dedup.page_count;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        uint64_t ns = deadline.tv_nsec + (uint64_t)dedup.config.round_interval_ms * 1000000ull;
+        deadline.tv_sec += ns / 1000000000ull;
+        deadline.tv_nsec = ns % 1000000000ull;
+
+        pthread_mutex_lock(&dedup.sleep_lock);
+        if (dedup.running) {
+            pthread_cond_timedwait(&dedup.sleep_cond, &dedup.sleep_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&dedup.sleep_lock);
+
+    return NULL;
+}
+
+static void dedup_free_state(void) {
+    if (dedup.frames && dedup.frames != MAP_FAILED) {
+        munmap(dedup.frames, (size_t)dedup.page_count * dedup.page_size);
+    }
+    if (dedup.memfd >= 0) {
+        close(dedup.memfd);
+    }
+    free(dedup.page_frame);
+    free(dedup.page_checksum);
+    free(dedup.page_excluded);
+    free(dedup.page_pins);
+    free(dedup.page_released);
+    free(dedup.frame_refs);
+    free(dedup.frame_checksum);
+    free(dedup.free_frames);
+    free(dedup.table);
+
+    dedup.frames = NULL;
+    dedup.memfd = -1;
+    dedup.page_frame = NULL;
+    dedup.page_checksum = NULL;
+    dedup.page_excluded = NULL;
+    dedup.page_pins = NULL;
+    dedup.page_released = NULL;
+    dedup.frame_refs = NULL;
+    dedup.frame_checksum = NULL;
+    dedup.free_frames = NULL;
+    dedup.table = NULL;
+}
+
+int dedup_start(void *base, size_t size, const dedup_config_t *config) {
+    if (dedup.running) {
+        log_warn("Dedup service already running.");
+        return 0;
+    }
+
+    if (!base || !config || config->pages_per_round == 0) {
+        log_error("Invalid dedup configuration");
+        return -1;
+    }
+
+    dedup.page_size = sysconf(_SC_PAGESIZE);
+    if (((uintptr_t)base | size) & (dedup.page_size - 1)) {
+        log_error("Dedup region must be page aligned");
+        return -1;
+    }
+
+    log_info("Starting guest memory dedup service...");
+
+    dedup.base = base;
+    dedup.size = size;
+    dedup.page_count = size / dedup.page_size;
+    dedup.config = *config;
+    dedup.cursor = 0;
+    dedup.free_count = 0;
+    dedup.next_frame = 0;
+    memset(&dedup.stats, 0, sizeof(dedup.stats));
+
+    size_t table_size = 1;
+    while (table_size < (size_t)dedup.page_count * 2) {
+        table_size <<= 1;
+    }
+    dedup.table_mask = table_size - 1;
+
+    dedup.page_frame = malloc(dedup.page_count * sizeof(uint32_t));
+    dedup.page_checksum = calloc(dedup.page_count, sizeof(uint64_t));
+    dedup.page_excluded = calloc(dedup.page_count, sizeof(uint8_t));
+    dedup.page_pins = calloc(dedup.page_count, sizeof(uint32_t));
+    dedup.page_released = calloc(dedup.page_count, sizeof(uint8_t));
+    dedup.frame_refs = calloc(dedup.page_count, sizeof(uint32_t));
+    dedup.frame_checksum = calloc(dedup.page_count, sizeof(uint64_t));
+    dedup.free_frames = malloc(dedup.page_count * sizeof(uint32_t));
+    dedup.table = calloc(table_size, sizeof(dedup_entry_t));
+    if (!dedup.page_frame || !dedup.page_checksum || !dedup.page_excluded || !dedup.page_pins ||
+        !dedup.page_released || !dedup.frame_refs ||
+        !dedup.frame_checksum || !dedup.free_frames || !dedup.table) {
+        log_error("Failed to allocate dedup metadata");
+        dedup_free_state();
+        return -1;
+    }
+    memset(dedup.page_frame, 0xff, dedup.page_count * sizeof(uint32_t));
+
+    uint8_t *zero_page = calloc(1, dedup.page_size);
+    if (!zero_page) {
+        dedup_free_state();
+        return -1;
+    }
+    dedup.zero_checksum = dedup_checksum(zero_page, dedup.page_size);
+    free(zero_page);
+
+    unsigned long max_map_count = DEDUP_DEFAULT_MAX_MAP_COUNT;
+    FILE *limit = fopen("/proc/sys/vm/max_map_count", "r");
+    if (limit) {
+        if (fscanf(limit, "%lu", &max_map_count) != 1) {
+            max_map_count = DEDUP_DEFAULT_MAX_MAP_COUNT;
+        }
+        fclose(limit);
+    }
+    dedup.max_shared = max_map_count / DEDUP_MAP_BUDGET_DIVISOR;
+    dedup.budget_logged = 0;
+
+    dedup.memfd = memfd_create("ghostvisor-dedup", MFD_CLOEXEC);
+    if (dedup.memfd < 0 || ftruncate(dedup.memfd, size) != 0) {
+        log_error("Failed to create dedup frame store: %s", strerror(errno));
+        dedup_free_state();
+        return -1;
+    }
+
+    dedup.frames = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, dedup.memfd, 0);
+    if (dedup.frames == MAP_FAILED) {
+        log_error("Failed to map dedup frame store: %s", strerror(errno));
+        dedup_free_state();
+        return -1;
+    }
+
+    if (pthread_mutex_init(&dedup.sleep_lock, NULL) != 0 ||
+        pthread_cond_init(&dedup.sleep_cond, NULL) != 0) {
+        dedup_free_state();
+        return -1;
+    }
+
+    dedup.running = 1;
+    if (pthread_create(&dedup.thread, NULL, dedup_thread, NULL) != 0) {
+        log_error("Failed to start dedup scanner thread");
+        dedup.running = 0;
+        pthread_cond_destroy(&dedup.sleep_cond);
+        pthread_mutex_destroy(&dedup.sleep_lock);
+        dedup_free_state();
+        return -1;
+    }
+
+    return 0;
+}
+
+void dedup_stop(void) {
+    if (!dedup.running) {
+        return;
+    }
+
+    dedup_stats_t stats;
+    dedup_get_stats(&stats);
+    log_info("Stopping dedup service: %llu pages shared, %llu bytes saved, %llu zero pages released",
+             stats.pages_shared, stats.bytes_saved, stats.zero_pages);
+
+    pthread_mutex_lock(&dedup.sleep_lock);
+    dedup.running = 0;
+    pthread_cond_signal(&dedup.sleep_cond);
+    pthread_mutex_unlock(&dedup.sleep_lock);
+    pthread_join(dedup.thread, NULL);
+
+    dedup_lock();
+    dedup_free_state();
+    dedup.base = NULL;
+    dedup.size = 0;
+    dedup.page_count = 0;
+    dedup_unlock();
+
+    pthread_cond_destroy(&dedup.sleep_cond);
+    pthread_mutex_destroy(&dedup.sleep_lock);
+}
+
+// Replaces a shared mapping with private anonymous memory, then fills it
+// from the frame through the store's own mapping. Caller holds the lock.
+static int dedup_unshare_page(uint32_t page) {
+    uint32_t frame = dedup.page_frame[page];
+
+    void *copy = mmap(dedup_page(page), dedup.page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (copy == MAP_FAILED) {
+        log_error("Failed to break page sharing: %s", strerror(errno));
+        return -1;
+    }
+    memcpy(copy, dedup_frame(frame), dedup.page_size);
+
+    dedup.page_frame[page] = DEDUP_NO_FRAME;
+    dedup.page_checksum[page] = 0;
+    dedup.stats.pages_shared--;
+    dedup.stats.cow_breaks++;
+
+    if (--dedup.frame_refs[frame] == 0) {
+        dedup_release_frame(frame);
+    }
+    return 0;
+}
+
+int dedup_handle_write_fault(void *addr) {
+    uint8_t *ptr = addr;
+
+    if (!dedup.running || ptr < dedup.base || ptr >= dedup.base + dedup.size) {
+        return 0;
+    }
+
+    uint32_t page = (ptr - dedup.base) / dedup.page_size;
+
+    dedup_lock();
+
+    if (dedup.page_frame[page] == DEDUP_NO_FRAME) {
+        // Never shared, or frozen for a compare and thawed while we waited
+        // on the lock. Pages the scan may touch are read/write outside the
+        // lock, so unless the guest protected this one, retrying succeeds.
+        int retry = !dedup.page_excluded[page];
+        dedup_unlock();
+        return retry;
+    }
+
+    int result = dedup_unshare_page(page) == 0 ? 1 : -1;
+    dedup_unlock();
+    return result;
+}
+
+// Clips [addr, addr + len) to the region as a page range. Returns 0 when
+// nothing overlaps.
+static int dedup_page_range(void *addr, size_t len, uint32_t *first, uint32_t *last) {
+    uint8_t *start = addr;
+
+    if (!dedup.running || len == 0 || start >= dedup.base + dedup.size ||
+        start + len <= dedup.base) {
+        return 0;
+    }
+
+    uint8_t *end = start + len;
+    if (start < dedup.base) start = dedup.base;
+    if (end > dedup.base + dedup.size) end = dedup.base + dedup.size;
+
+    *first = (start - dedup.base) / dedup.page_size;
+    *last = (end - dedup.base + dedup.page_size - 1) / dedup.page_size;
+    return 1;
+}
+
+int dedup_pin(void *addr, size_t len) {
+    uint32_t first, last;
+    if (!dedup_page_range(addr, len, &first, &last)) {
+        return 0;
+    }
+
+    int result = 0;
+    dedup_lock();
+    for (uint32_t page = first; page < last; page++) {
+        if (dedup.page_frame[page] != DEDUP_NO_FRAME && dedup_unshare_page(page) != 0) {
+            result = -1;
+        }
+        dedup.page_pins[page]++;
+        dedup.page_checksum[page] = 0;
+    }
+    dedup_unlock();
+    return result;
+}
+
+void dedup_unpin(void *addr, size_t len) {
+    uint32_t first, last;
+    if (!dedup_page_range(addr, len, &first, &last)) {
+        return;
+    }
+
+    dedup_lock();
+    for (uint32_t page = first; page < last; page++) {
+        if (dedup.page_pins[page]) {
+            dedup.page_pins[page]--;
+        }
+    }
+    dedup_unlock();
+}
+
+int dedup_set_excluded(void *addr, size_t len, int excluded) {
+    uint32_t first, last;
+    if (!dedup_page_range(addr, len, &first, &last)) {
+        return 0;
+    }
+
+    int result = 0;
+    dedup_lock();
+    for (uint32_t page = first; page < last; page++) {
+        if (excluded && dedup.page_frame[page] != DEDUP_NO_FRAME &&
+            dedup_unshare_page(page) != 0) {
+            result = -1;
+        }
+        dedup.page_excluded[page] = excluded != 0;
+        dedup.page_checksum[page] = 0;
+    }
+    dedup_unlock();
+
+    return result;
+}
+
+void dedup_get_stats(dedup_stats_t *stats) {
+    if (!stats) return;
+
+    dedup_lock();
+    *stats = dedup.stats;
+    stats->bytes_saved = (stats->pages_shared - stats->frames) * dedup.page_size;
+    dedup_unlock();
+}
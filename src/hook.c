@@ -1,14 +1,148 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "hook.h"
+#include "scan.h"
 #include "util.h"
 #include <dlfcn.h>
 
+#define HOOK_CACHE_LINE 64
+
+// Structure-of-arrays hook table. keys (and ends for memory regions) are
+// the only arrays a lookup walks, packed eight to a cache line; handlers
+// is indexed once on a hit and meta holds everything else.
+typedef struct {
+    uint64_t *keys;
+    uint64_t *ends;
+    hook_handler_func_t *handlers;
+    hook_handler_t *meta;
+    hook_stats_t *stats;
+    int count;
+    int capacity;
+} hook_table_t;
+
 static int hook_initialized = 0;
-static hook_handler_t *syscall_handlers = NULL;
-static hook_handler_t *memory_handlers = NULL;
-static hook_handler_t *exception_handlers = NULL;
+static int hook_timing = 0;
+// Serializes registrations only; lookups read count with acquire and never
+// take it.
+static pthread_mutex_t hook_register_lock = PTHREAD_MUTEX_INITIALIZER;
+static hook_table_t syscall_hooks;
+static hook_table_t memory_hooks;
+static hook_table_t exception_hooks;
+
+static void *hook_alloc_array(size_t count, size_t size) {
+    size_t bytes = (count * size + HOOK_CACHE_LINE - 1) & ~(size_t)(HOOK_CACHE_LINE - 1);
+    void *array = aligned_alloc(HOOK_CACHE_LINE, bytes);
+    if (array) {
+        memset(array, 0, bytes);
+    }
+    return array;
+}
+
+static int hook_table_init(hook_table_t *table, int capacity, int ranged) {
+    memset(table, 0, sizeof(*table));
+    table->capacity = capacity;
+    table->keys = hook_alloc_array(capacity, sizeof(uint64_t));
+    table->handlers = hook_alloc_array(capacity, sizeof(hook_handler_func_t));
+    table->meta = calloc(capacity, sizeof(hook_handler_t));
+    table->stats = hook_alloc_array(capacity, sizeof(hook_stats_t));
+    if (ranged) {
+        table->ends = hook_alloc_array(capacity, sizeof(uint64_t));
+    }
+
+    if (!table->keys || !table->handlers || !table->meta || !table->stats ||
+        (ranged && !table->ends)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void hook_table_free(hook_table_t *table) {
+    for (int i = 0; i < table->count; i++) {
+        free(table->meta[i].lib_path);
+        free(table->meta[i].symbol);
+    }
+    free(table->keys);
+    free(table->ends);
+    free(table->handlers);
+    free(table->meta);
+    free(table->stats);
+    memset(table, 0, sizeof(*table));
+}
+
+static hook_table_t *hook_table_for(hook_type_t type) {
+    switch (type) {
+        case HOOK_TYPE_SYSCALL:
+            return &syscall_hooks;
+        case HOOK_TYPE_MEMORY:
+            return &memory_hooks;
+        case HOOK_TYPE_EXCEPTION:
+            return &exception_hooks;
+        default:
+            return NULL;
+    }
+}
+
+static int hook_add(hook_type_t type, uint64_t id,
+                    uint64_t region_start, uint64_t region_end,
+                    hook_handler_func_t handler,
+                    const char *lib_path, const char *symbol) {
+    if (!hook_initialized) {
+        log_error("Hook subsystem not initialized.");
+        return -1;
+    }
+
+    hook_table_t *table = hook_table_for(type);
+    if (!table) {
+        log_error("Invalid hook type: %d", type);
+        return -1;
+    }
+
+    if (!handler) {
+        log_error("Refusing to register a NULL handler for type: %d", type);
+        return -1;
+    }
+
+    pthread_mutex_lock(&hook_register_lock);
+    if (table->count == table->capacity) {
+        pthread_mutex_unlock(&hook_register_lock);
+        log_error("No free handler slots for type: %d", type);
+        return -1;
+    }
+
+    int i = table->count;
+    if (lib_path && symbol) {
+        table->meta[i].lib_path = strdup(lib_path);
+        table->meta[i].symbol = strdup(symbol);
+        if (!table->meta[i].lib_path || !table->meta[i].symbol) {
+            free(table->meta[i].lib_path);
+            free(table->meta[i].symbol);
+            table->meta[i].lib_path = table->meta[i].symbol = NULL;
+            pthread_mutex_unlock(&hook_register_lock);
+            log_error("Failed to record hook symbol %s", symbol);
+            return -1;
+        }
+    }
+
+    table->keys[i] = type == HOOK_TYPE_MEMORY ? region_start : id;
+    if (table->ends) {
+        table->ends[i] = region_end;
+    }
+    table->handlers[i] = handler;
+    table->meta[i].type = type;
+    table->meta[i].id = id;
+    table->meta[i].region_start = region_start;
+    table->meta[i].region_end = region_end;
+    table->meta[i].handler = handler;
+    table->meta[i].stats = &table->stats[i];
+
+    // Publish the slot only after its key and handler are in place.
+    __atomic_store_n(&table->count, i + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&hook_register_lock);
+    return 0;
+}
 
 static void *load_dynamic_library(const char *lib_path) {
     void *handle = dlopen(lib_path, RTLD_LAZY);
@@ -39,7 +173,7 @@ int register_dynamic_hook(const char *lib_path, const char *func_name, hook_type
         return -1;
     }
 
-    return register_hook(type, id, region_start, region_end, handler);
+    return hook_add(type, id, region_start, region_end, handler, lib_path, func_name);
 }
 
 int hook_init(void) {
@@ -49,14 +183,18 @@ int hook_init(void) {
     }
     
     log_info("Initializing hooking subsystem...");
+
+    if (scan_init(SCAN_IMPL_AUTO) != 0) {
+        return -1;
+    }
     
-    syscall_handlers = calloc(MAX_SYSCALL_HANDLERS, sizeof(hook_handler_t));
-    memory_handlers = calloc(MAX_MEMORY_HANDLERS, sizeof(hook_handler_t)); 
-    exception_handlers = calloc(MAX_EXCEPTION_HANDLERS, sizeof(hook_handler_t));
-    
-    if (!syscall_handlers || !memory_handlers || !exception_handlers) {
+    if (hook_table_init(&syscall_hooks, MAX_SYSCALL_HANDLERS, 0) != 0 ||
+        hook_table_init(&memory_hooks, MAX_MEMORY_HANDLERS, 1) != 0 ||
+        hook_table_init(&exception_hooks, MAX_EXCEPTION_HANDLERS, 0) != 0) {
         log_error("Failed to allocate handler arrays");
-        hook_cleanup();
+        hook_table_free(&syscall_hooks);
+        hook_table_free(&memory_hooks);
+        hook_table_free(&exception_hooks);
         return -1;
     }
 
@@ -64,6 +202,82 @@ int hook_init(void) {
     return 0;
 }
 
+static size_t hook_find(hook_table_t *table, hook_type_t type, uint64_t key) {
+    int count = __atomic_load_n(&table->count, __ATOMIC_ACQUIRE);
+
+    if (type == HOOK_TYPE_MEMORY) {
+        return scan_find_range(table->keys, table->ends, count, key);
+    }
+    return scan_find_u64(table->keys, count, key);
+}
+
+hook_handler_func_t hook_lookup(hook_type_t type, uint64_t key) {
+    hook_table_t *table = hook_table_for(type);
+    if (!table) return NULL;
+
+    size_t index = hook_find(table, type, key);
+    return index == SCAN_NOT_FOUND ? NULL : table->handlers[index];
+}
+
+void hook_set_timing(int enabled) {
+    __atomic_store_n(&hook_timing, enabled, __ATOMIC_RELAXED);
+}
+
+static uint64_t hook_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void hook_record(hook_stats_t *stats, uint64_t elapsed) {
+    int bucket = elapsed ? 63 - __builtin_clzll(elapsed) - 7 : 0;
+    if (bucket < 0) bucket = 0;
+    if (bucket >= HOOK_LATENCY_BUCKETS) bucket = HOOK_LATENCY_BUCKETS - 1;
+
+    __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&stats->max_ns, &max, elapsed, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Looks up and runs the hook for key. Returns 1 when nothing matched,
+// otherwise the handler's result.
+static int hook_dispatch(hook_type_t type, uint64_t key, const trap_event_t *event, int *result) {
+    hook_table_t *table = hook_table_for(type);
+    size_t index = hook_find(table, type, key);
+    if (index == SCAN_NOT_FOUND) {
+        return 1;
+    }
+
+    if (!__atomic_load_n(&hook_timing, __ATOMIC_RELAXED)) {
+        *result = table->handlers[index](event);
+        return 0;
+    }
+
+    uint64_t start = hook_now_ns();
+    *result = table->handlers[index](event);
+    hook_record(&table->stats[index], hook_now_ns() - start);
+    return 0;
+}
+
+int hook_for_each(hook_visit_func_t visit, void *arg) {
+    hook_table_t *tables[] = { &syscall_hooks, &memory_hooks, &exception_hooks };
+
+    for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) {
+        int count = __atomic_load_n(&tables[t]->count, __ATOMIC_ACQUIRE);
+        for (int i = 0; i < count; i++) {
+            int result = visit(&tables[t]->meta[i], arg);
+            if (result != 0) return result;
+        }
+    }
+    return 0;
+}
+
 int handle_syscall(const trap_event_t *event) {
     if (!hook_initialized) {
         log_error("Hook subsystem not initialized.");
@@ -73,13 +287,9 @@ int handle_syscall(const trap_event_t *event) {
     log_debug("Handling syscall trap, number: %llu", event->data);
 
     // Look for registered handlers for this syscall
-    for (int i = 0; i < MAX_SYSCALL_HANDLERS; i++) {
-        if (syscall_handlers[i].type == HOOK_TYPE_SYSCALL && 
-            syscall_handlers[i].id == event->data &&
-            syscall_handlers[i].handler) {
-            
-            return syscall_handlers[i].handler(event);
-        }
+    int result;
+    if (hook_dispatch(HOOK_TYPE_SYSCALL, event->data, event, &result) == 0) {
+        return result;
     }
 
     log_warn("No handler found for syscall: %llu", event->data);
@@ -94,14 +304,9 @@ int handle_memory_access(const trap_event_t *event) {
 
     log_debug("Handling memory access trap at address: 0x%llx", event->address);
 
-    for (int i = 0; i < MAX_MEMORY_HANDLERS; i++) {
-        if (memory_handlers[i].type == HOOK_TYPE_MEMORY &&
-            event->address >= memory_handlers[i].region_start &&
-            event->address <= memory_handlers[i].region_end &&
-            memory_handlers[i].handler) {
-            
-            return memory_handlers[i].handler(event);
-        }
+    int result;
+    if (hook_dispatch(HOOK_TYPE_MEMORY, event->address, event, &result) == 0) {
+        return result;
     }
 
     log_warn("No handler found for memory access at: 0x%llx", event->address);
@@ -116,62 +321,19 @@ int handle_exception(const trap_event_t *event) {
 
     log_debug("Handling exception trap, code: 0x%llx", event->data);
 
-    for (int i = 0; i < MAX_EXCEPTION_HANDLERS; i++) {
-        if (exception_handlers[i].type == HOOK_TYPE_EXCEPTION &&
-            exception_handlers[i].id == event->data &&
-            exception_handlers[i].handler) {
-            
-            return exception_handlers[i].handler(event);
-        }
+    int result;
+    if (hook_dispatch(HOOK_TYPE_EXCEPTION, event->data, event, &result) == 0) {
+        return result;
     }
 
     log_error("No handler found for exception: 0x%llx", event->data);
     return -1;
 }
 
-int register_hook(hook_type_t type, uint64_t id, 
-                 uint64_t region_start, uint64_t region_end,
-                 hook_handler_func_t handler) {
-    
-    if (!hook_initialized) {
-        log_error("Hook subsystem not initialized.");
-        return -1;
-    }
-
-    hook_handler_t *handlers;
-    int max_handlers;
-
-    switch(type) {
-        case HOOK_TYPE_SYSCALL:
-            handlers = syscall_handlers;
-            max_handlers = MAX_SYSCALL_HANDLERS;
-            break;
-        case HOOK_TYPE_MEMORY:
-            handlers = memory_handlers; 
-            max_handlers = MAX_MEMORY_HANDLERS;
-            break;
-        case HOOK_TYPE_EXCEPTION:
-            handlers = exception_handlers;
-            max_handlers = MAX_EXCEPTION_HANDLERS;
-            break;
-        default:
-            log_error("Invalid hook type: %d", type);
-            return -1;
-    }
-
-    for (int i = 0; i < max_handlers; i++) {
-        if (!handlers[i].handler) {
-            handlers[i].type = type;
-            handlers[i].id = id;
-            handlers[i].region_start = region_start;
-            handlers[i].region_end = region_end;
-            handlers[i].handler = handler;
-            return 0;
-        }
-    }
-
-    log_error("No free handler slots for type: %d", type);
-    return -1;
+int register_hook(hook_type_t type, uint64_t id,
+                  uint64_t region_start, uint64_t region_end,
+                  hook_handler_func_t handler) {
+    return hook_add(type, id, region_start, region_end, handler, NULL, NULL);
 }
 
 void hook_cleanup(void) {
@@ -182,13 +344,9 @@ void hook_cleanup(void) {
 
     log_info("Cleaning up hooking subsystem...");
     
-    free(syscall_handlers);
-    free(memory_handlers);
-    free(exception_handlers);
-    
-    syscall_handlers = NULL;
-    memory_handlers = NULL;
-    exception_handlers = NULL;
+    hook_table_free(&syscall_hooks);
+    hook_table_free(&memory_hooks);
+    hook_table_free(&exception_hooks);
     
     hook_initialized = 0;
 }
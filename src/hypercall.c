@@ -1,21 +1,170 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "hypercall.h"
+#include "arena.h"
+#include "irq.h"
+#include "timer.h"
+#include "trap.h"
 #include "util.h"
 #include "vm.h"
 
 #define MAX_LOG_SIZE 1024
+#define MAX_COMPLETION_ENTRIES 4096
+#define HYPERCALL_PENDING_PREALLOC 64
 
+typedef int (*hypercall_handler_t)(hypercall_regs_t *regs);
+
+// Per-vCPU completion channel. Only the owning vCPU changes it; workers
+// just decrement in_flight once a completion has been written.
 typedef struct {
-    uint64_t memory_size;
-    uint32_t vcpu_count;
-    uint32_t features;
-} vm_info_t;
+    uint64_t ring;
+    uint32_t entries;
+    uint64_t irq;
+    uint64_t next_ticket;
+    atomic_uint in_flight;
+} hypercall_channel_t;
 
-typedef int (*hypercall_handler_t)(hypercall_regs_t *regs);
+// A call that returned HYPERCALL_PENDING, carried to a trap worker with
+// its own copy of the registers and of the channel it reports to.
+typedef struct {
+    pool_task_t task;
+    hypercall_regs_t regs;
+    hypercall_handler_t work;
+    hypercall_channel_t *channel;
+    int vcpu_id;
+    uint64_t ring;
+    uint32_t entries;
+    uint64_t irq;
+    uint64_t ticket;
+    uint64_t started_ns;
+} hypercall_pending_t;
 
 static hypercall_handler_t hypercall_handlers[MAX_HYPERCALL];
+static hypercall_channel_t hypercall_channels[TRAP_MAX_VCPUS];
+static hypercall_stats_t hypercall_stats[MAX_HYPERCALL];
+
+// Pending calls are allocated on the vCPU and freed on a trap worker, so
+// the slab needs a lock; it is only held for the free-list push/pop.
+static slab_t hypercall_pending_slab;
+static pthread_mutex_t hypercall_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static hypercall_pending_t *hypercall_pending_alloc(void) {
+    pthread_mutex_lock(&hypercall_pending_lock);
+    hypercall_pending_t *pending = slab_alloc(&hypercall_pending_slab);
+    pthread_mutex_unlock(&hypercall_pending_lock);
+    if (pending) {
+        memset(pending, 0, sizeof(*pending));
+    }
+    return pending;
+}
+
+static void hypercall_pending_free(hypercall_pending_t *pending) {
+    pthread_mutex_lock(&hypercall_pending_lock);
+    slab_free(&hypercall_pending_slab, pending);
+    pthread_mutex_unlock(&hypercall_pending_lock);
+}
+
+static void hypercall_record(uint64_t nr, uint64_t started_ns, int result, int async) {
+    hypercall_stats_t *stats = &hypercall_stats[nr];
+    uint64_t elapsed = timer_now_ns() - started_ns;
+
+    __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->total_ns, elapsed, __ATOMIC_RELAXED);
+    if (async) {
+        __atomic_fetch_add(&stats->async_calls, 1, __ATOMIC_RELAXED);
+    }
+    if (result < 0) {
+        __atomic_fetch_add(&stats->failures, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max &&
+           !__atomic_compare_exchange_n(&stats->max_ns, &max, elapsed, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void hypercall_complete(pool_task_t *task, void *arg) {
+    (void)task;
+    hypercall_pending_t *pending = (hypercall_pending_t *)arg;
+
+    pending->regs.ret = 0;
+    int result = pending->work(&pending->regs);
+    int64_t ret = result < 0 ? result : (int64_t)pending->regs.ret;
+
+    // ret must be visible before the ticket that tells the guest it's there.
+    uint64_t entry = pending->ring +
+                     ((pending->ticket - 1) % pending->entries) * sizeof(hypercall_completion_t);
+    if (vm_write_memory(&ret, (void *)(uintptr_t)(entry + offsetof(hypercall_completion_t, ret)),
+                        sizeof(ret)) != 0) {
+        log_error("Failed to post hypercall %llu completion", pending->regs.nr);
+    } else {
+        atomic_thread_fence(memory_order_release);
+        vm_write_memory(&pending->ticket, (void *)(uintptr_t)entry, sizeof(pending->ticket));
+    }
+
+    atomic_fetch_sub_explicit(&pending->channel->in_flight, 1, memory_order_release);
+    if (pending->irq != HYPERCALL_NO_IRQ) {
+        vm_raise_irq(pending->vcpu_id, pending->irq);
+    }
+
+    hypercall_record(pending->regs.nr, pending->started_ns, result, 1);
+    hypercall_pending_free(pending);
+}
+
+// Hands work to a trap worker and returns HYPERCALL_PENDING. Calls that
+// have nowhere to report to (no channel, ring entry not yet consumed, not
+// on a vCPU) just run inline.
+static int hypercall_defer(hypercall_regs_t *regs, hypercall_handler_t work) {
+    int vcpu_id = vm_current_vcpu();
+    if (vcpu_id < 0) {
+        return work(regs);
+    }
+
+    hypercall_channel_t *channel = &hypercall_channels[vcpu_id];
+    if (!channel->ring ||
+        atomic_load_explicit(&channel->in_flight, memory_order_acquire) >= channel->entries) {
+        return work(regs);
+    }
+
+    uint64_t ticket = channel->next_ticket + 1;
+    uint64_t entry = channel->ring + ((ticket - 1) % channel->entries) * sizeof(hypercall_completion_t);
+    uint64_t unconsumed;
+    if (vm_read_memory((const void *)(uintptr_t)entry, &unconsumed, sizeof(unconsumed)) != 0 ||
+        unconsumed != 0) {
+        return work(regs);
+    }
+
+    hypercall_pending_t *pending = hypercall_pending_alloc();
+    if (!pending) {
+        return work(regs);
+    }
+
+    pending->regs = *regs;
+    pending->work = work;
+    pending->channel = channel;
+    pending->vcpu_id = vcpu_id;
+    pending->ring = channel->ring;
+    pending->entries = channel->entries;
+    pending->irq = channel->irq;
+    pending->ticket = ticket;
+    pending->started_ns = timer_now_ns();
+    pool_task_init(&pending->task, hypercall_complete, pending);
+
+    atomic_fetch_add_explicit(&channel->in_flight, 1, memory_order_relaxed);
+    if (vm_submit_task(&pending->task) != 0) {
+        atomic_fetch_sub_explicit(&channel->in_flight, 1, memory_order_relaxed);
+        hypercall_pending_free(pending);
+        return work(regs);
+    }
+
+    channel->next_ticket = ticket;
+    regs->ret = ticket;
+    return HYPERCALL_PENDING;
+}
 
 static int handle_log(hypercall_regs_t *regs) {
     char *msg = (char *)regs->arg1;
@@ -26,17 +175,21 @@ static int handle_log(hypercall_regs_t *regs) {
         return -1;
     }
 
-    char *safe_msg = malloc(len + 1);
+    arena_t *scratch = arena_thread_scratch();
+    if (!scratch) return -1;
+
+    arena_mark_t mark = arena_mark(scratch);
+    char *safe_msg = arena_alloc(scratch, len + 1);
     if (!safe_msg) return -1;
     
     if (vm_read_memory(msg, safe_msg, len) != 0) {
-        free(safe_msg);
+        arena_release(scratch, mark);
         return -1;
     }
     safe_msg[len] = '\0';
 
     log_info("Guest: %s", safe_msg);
-    free(safe_msg);
+    arena_release(scratch, mark);
     return 0;
 }
 
@@ -55,7 +208,7 @@ static int handle_query_info(hypercall_regs_t *regs) {
     return 0;
 }
 
-static int handle_map_memory(hypercall_regs_t *regs) {
+static int map_memory_work(hypercall_regs_t *regs) {
     uint64_t guest_addr = regs->arg1;
     uint64_t size = regs->arg2;
     uint32_t flags = regs->arg3;
@@ -63,13 +216,58 @@ static int handle_map_memory(hypercall_regs_t *regs) {
     return vm_map_memory(guest_addr, size, flags);
 }
 
-static int handle_unmap_memory(hypercall_regs_t *regs) {
+static int unmap_memory_work(hypercall_regs_t *regs) {
     uint64_t guest_addr = regs->arg1;
     uint64_t size = regs->arg2;
 
     return vm_unmap_memory(guest_addr, size);
 }
 
+static int handle_map_memory(hypercall_regs_t *regs) {
+    if (regs->arg2 >= HYPERCALL_ASYNC_MAP_SIZE) {
+        return hypercall_defer(regs, map_memory_work);
+    }
+    return map_memory_work(regs);
+}
+
+static int handle_unmap_memory(hypercall_regs_t *regs) {
+    if (regs->arg2 >= HYPERCALL_ASYNC_MAP_SIZE) {
+        return hypercall_defer(regs, unmap_memory_work);
+    }
+    return unmap_memory_work(regs);
+}
+
+static int map_batch_work(hypercall_regs_t *regs) {
+    const void *guest_ranges = (const void *)regs->arg1;
+    uint64_t count = regs->arg2;
+
+    if (count == 0 || count > MEMMAP_MAX_BATCH) {
+        log_error("Invalid mapping batch of %llu ranges", count);
+        return -1;
+    }
+
+    arena_t *scratch = arena_thread_scratch();
+    if (!scratch) return -1;
+
+    arena_mark_t mark = arena_mark(scratch);
+    memmap_range_t *ranges = arena_alloc(scratch, count * sizeof(memmap_range_t));
+    if (!ranges) return -1;
+
+    int result = vm_read_memory(guest_ranges, ranges, count * sizeof(memmap_range_t));
+    if (result == 0) {
+        result = vm_map_batch(ranges, count);
+    }
+    arena_release(scratch, mark);
+    return result;
+}
+
+static int handle_map_batch(hypercall_regs_t *regs) {
+    if (regs->arg2 >= HYPERCALL_ASYNC_MAP_BATCH) {
+        return hypercall_defer(regs, map_batch_work);
+    }
+    return map_batch_work(regs);
+}
+
 static int handle_register_irq(hypercall_regs_t *regs) {
     uint32_t irq = regs->arg1;
     uint64_t handler = regs->arg2;
@@ -77,16 +275,76 @@ static int handle_register_irq(hypercall_regs_t *regs) {
     return vm_register_irq_handler(irq, handler);
 }
 
+static int handle_set_timer(hypercall_regs_t *regs) {
+    uint32_t timer_id = regs->arg1;
+    uint32_t irq = regs->arg2;
+    uint64_t delay_ns = regs->arg3;
+
+    if (delay_ns == 0) {
+        return vm_cancel_guest_timer(VM_CALLING_VCPU, timer_id);
+    }
+    return vm_arm_guest_timer(VM_CALLING_VCPU, timer_id, irq, delay_ns, 0);
+}
+
+static int handle_set_completion(hypercall_regs_t *regs) {
+    uint64_t ring = regs->arg1;
+    uint64_t entries = regs->arg2;
+    uint64_t irq = regs->arg3;
+
+    int vcpu_id = vm_current_vcpu();
+    if (vcpu_id < 0) {
+        log_error("Completion channels belong to a vCPU");
+        return -1;
+    }
+
+    hypercall_channel_t *channel = &hypercall_channels[vcpu_id];
+    if (atomic_load_explicit(&channel->in_flight, memory_order_acquire) != 0) {
+        log_error("vCPU %d changed its completion channel with calls in flight", vcpu_id);
+        return -1;
+    }
+
+    if (ring && (entries == 0 || entries > MAX_COMPLETION_ENTRIES ||
+                 (irq != HYPERCALL_NO_IRQ && irq >= IRQ_MAX))) {
+        log_error("Invalid completion channel: %llu entries, IRQ %llu", entries, irq);
+        return -1;
+    }
+
+    channel->ring = ring;
+    channel->entries = ring ? entries : 0;
+    channel->irq = irq;
+    return 0;
+}
+
+void hypercall_get_stats(uint64_t nr, hypercall_stats_t *stats) {
+    if (nr >= MAX_HYPERCALL || !stats) return;
+
+    hypercall_stats_t *src = &hypercall_stats[nr];
+    stats->calls = __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+    stats->async_calls = __atomic_load_n(&src->async_calls, __ATOMIC_RELAXED);
+    stats->failures = __atomic_load_n(&src->failures, __ATOMIC_RELAXED);
+    stats->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+    stats->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+}
+
 int hypercall_init(void) {
     log_info("Initializing hypercall subsystem...");
 
     memset(hypercall_handlers, 0, sizeof(hypercall_handlers));
 
+    if (slab_init(&hypercall_pending_slab, sizeof(hypercall_pending_t),
+                  _Alignof(hypercall_pending_t), HYPERCALL_PENDING_PREALLOC) != 0) {
+        log_error("Failed to allocate pending hypercall slab");
+        return -1;
+    }
+
     hypercall_handlers[HYPERCALL_LOG] = handle_log;
     hypercall_handlers[HYPERCALL_QUERY_INFO] = handle_query_info;
     hypercall_handlers[HYPERCALL_MAP_MEMORY] = handle_map_memory;
     hypercall_handlers[HYPERCALL_UNMAP_MEMORY] = handle_unmap_memory;
     hypercall_handlers[HYPERCALL_REGISTER_IRQ] = handle_register_irq;
+    hypercall_handlers[HYPERCALL_SET_TIMER] = handle_set_timer;
+    hypercall_handlers[HYPERCALL_SET_COMPLETION] = handle_set_completion;
+    hypercall_handlers[HYPERCALL_MAP_BATCH] = handle_map_batch;
 
     return 0;
 }
@@ -103,10 +361,29 @@ int handle_hypercall(hypercall_regs_t *regs) {
     }
 
     log_debug("Handling hypercall %llu", regs->nr);
-    return hypercall_handlers[regs->nr](regs);
+
+    uint64_t started = timer_now_ns();
+    int result = hypercall_handlers[regs->nr](regs);
+    if (result != HYPERCALL_PENDING) {
+        hypercall_record(regs->nr, started, result, 0);
+    }
+    return result;
 }
 
 void hypercall_cleanup(void) {
     log_info("Cleaning up hypercall subsystem...");
+
+    for (int i = 0; i < MAX_HYPERCALL; i++) {
+        if (hypercall_stats[i].calls) {
+            log_info("Hypercall %d: %llu calls (%llu async, %llu failed), avg %llu ns, max %llu ns",
+                     i, hypercall_stats[i].calls, hypercall_stats[i].async_calls,
+                     hypercall_stats[i].failures,
+                     hypercall_stats[i].total_ns / hypercall_stats[i].calls,
+                     hypercall_stats[i].max_ns);
+        }
+    }
+
     memset(hypercall_handlers, 0, sizeof(hypercall_handlers));
+    // The pool has been drained by now, so no completion still holds one.
+    slab_destroy(&hypercall_pending_slab);
 }
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "irq.h"
+#include "trap.h"
+#include "util.h"
+
+#define IRQ_WORDS (IRQ_MAX / 64)
+#define IRQ_CACHE_LINE 64
+
+// One posted-interrupt descriptor per vCPU. Raisers only ever OR bits into
+// pending[], and the owning vCPU claims them with an exchange, so neither
+// side takes a lock. Each descriptor sits on its own cache line so raising
+// on one vCPU does not bounce the others' lines.
+typedef struct {
+    _Atomic uint64_t pending[IRQ_WORDS];
+    atomic_int sleeping;
+    atomic_int doorbell_sent;
+    _Atomic uint64_t raised;
+    _Atomic uint64_t coalesced;
+    _Atomic uint64_t doorbells;
+    uint64_t delivered;
+    uint64_t unhandled;
+} __attribute__((aligned(IRQ_CACHE_LINE))) irq_vcpu_t;
+
+typedef struct {
+    int initialized;
+    int vcpu_count;
+    irq_vcpu_t *vcpus;
+    _Atomic uint64_t handlers[IRQ_MAX];
+} irq_state_t;
+
+static irq_state_t irq_state = {0};
+
+static irq_vcpu_t *irq_vcpu(int vcpu_id) {
+    if (!irq_state.initialized || vcpu_id < 0 || vcpu_id >= irq_state.vcpu_count) {
+        return NULL;
+    }
+    return &irq_state.vcpus[vcpu_id];
+}
+
+int irq_init(int vcpu_count) {
+    if (irq_state.initialized) {
+        log_warn("IRQ subsystem already initialized.");
+        return 0;
+    }
+
+    if (vcpu_count <= 0) {
+        log_error("Invalid vCPU count for IRQ subsystem: %d", vcpu_count);
+        return -1;
+    }
+
+    size_t size = vcpu_count * sizeof(irq_vcpu_t);
+    irq_state.vcpus = aligned_alloc(IRQ_CACHE_LINE, size);
+    if (!irq_state.vcpus) {
+        log_error("Failed to allocate posted-interrupt descriptors");
+        return -1;
+    }
+    memset(irq_state.vcpus, 0, size);
+
+    for (int i = 0; i < IRQ_MAX; i++) {
+        atomic_init(&irq_state.handlers[i], 0);
+    }
+
+    irq_state.vcpu_count = vcpu_count;
+    irq_state.initialized = 1;
+    return 0;
+}
+
+void irq_cleanup(void) {
+    if (!irq_state.initialized) {
+        return;
+    }
+
+    for (int i = 0; i < irq_state.vcpu_count; i++) {
+        if (irq_state.vcpus[i].unhandled) {
+            log_warn("vCPU %d: %llu IRQs raised with no guest handler.", i,
+                     irq_state.vcpus[i].unhandled);
+        }
+    }
+
+    free(irq_state.vcpus);
+    irq_state.vcpus = NULL;
+    irq_state.vcpu_count = 0;
+    irq_state.initialized = 0;
+}
+
+int irq_register_handler(uint32_t irq, uint64_t guest_handler) {
+    if (irq >= IRQ_MAX) {
+        log_error("Invalid IRQ number: %u", irq);
+        return -1;
+    }
+
+    atomic_store_explicit(&irq_state.handlers[irq], guest_handler, memory_order_release);
+    log_debug("Registered guest IRQ %u handler at 0x%llx", irq, guest_handler);
+    return 0;
+}
+
+uint64_t irq_get_handler(uint32_t irq) {
+    if (irq >= IRQ_MAX) {
+        return 0;
+    }
+    return atomic_load_explicit(&irq_state.handlers[irq], memory_order_acquire);
+}
+
+int irq_raise(int vcpu_id, uint32_t irq) {
+    if (irq >= IRQ_MAX) {
+        return -1;
+    }
+
+    if (vcpu_id == IRQ_ANY_VCPU && irq_state.initialized) {
+        vcpu_id = irq % irq_state.vcpu_count;
+    }
+
+    irq_vcpu_t *vcpu = irq_vcpu(vcpu_id);
+    if (!vcpu) {
+        return -1;
+    }
+
+    uint64_t bit = 1ull << (irq % 64);
+    uint64_t old = atomic_fetch_or(&vcpu->pending[irq / 64], bit);
+    atomic_fetch_add_explicit(&vcpu->raised, 1, memory_order_relaxed);
+
+    if (old & bit) {
+        atomic_fetch_add_explicit(&vcpu->coalesced, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    // Pairs with the sleeping store / pending load in irq_prepare_sleep():
+    // either the vCPU sees our bit before it blocks, or we see it asleep.
+    // Only the first raiser after it dozes off pays for the eventfd write.
+    if (atomic_load(&vcpu->sleeping) &&
+        !atomic_exchange(&vcpu->doorbell_sent, 1)) {
+        atomic_fetch_add_explicit(&vcpu->doorbells, 1, memory_order_relaxed);
+        trap_kick_vcpu(vcpu_id);
+    }
+
+    return 0;
+}
+
+int irq_prepare_sleep(int vcpu_id) {
+    irq_vcpu_t *vcpu = irq_vcpu(vcpu_id);
+    if (!vcpu) return 0;
+
+    atomic_store(&vcpu->sleeping, 1);
+    for (int i = 0; i < IRQ_WORDS; i++) {
+        if (atomic_load(&vcpu->pending[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void irq_wake(int vcpu_id) {
+    irq_vcpu_t *vcpu = irq_vcpu(vcpu_id);
+    if (!vcpu) return;
+
+    atomic_store(&vcpu->sleeping, 0);
+    atomic_store(&vcpu->doorbell_sent, 0);
+}
+
+int irq_deliver_pending(int vcpu_id) {
+    irq_vcpu_t *vcpu = irq_vcpu(vcpu_id);
+    if (!vcpu) return 0;
+
+    int delivered = 0;
+    for (int word = 0; word < IRQ_WORDS; word++) {
+        if (!atomic_load_explicit(&vcpu->pending[word], memory_order_relaxed)) {
+            continue;
+        }
+
+        uint64_t bits = atomic_exchange_explicit(&vcpu->pending[word], 0, memory_order_acquire);
+        while (bits) {
+            uint32_t irq = word * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            uint64_t handler = atomic_load_explicit(&irq_state.handlers[irq], memory_order_acquire);
+            // Counted, not logged: a guest that leaves an IRQ unhandled
+            // would otherwise write to stderr on every delivery.
+            if (!handler) {
+                if (vcpu->unhandled++ == 0) {
+                    log_warn("IRQ %u raised on vCPU %d with no guest handler; "
+                             "further ones are only counted", irq, vcpu_id);
+                }
+                continue;
+            }
+
+            log_debug("Injecting IRQ %u into vCPU %d (handler 0x%llx)", irq, vcpu_id, handler);
+            vcpu->delivered++;
+            delivered++;
+        }
+    }
+
+    return delivered;
+}
+
+void irq_get_stats(int vcpu_id, irq_stats_t *stats) {
+    irq_vcpu_t *vcpu = irq_vcpu(vcpu_id);
+    if (!stats) return;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!vcpu) return;
+
+    stats->raised = atomic_load_explicit(&vcpu->raised, memory_order_relaxed);
+    stats->coalesced = atomic_load_explicit(&vcpu->coalesced, memory_order_relaxed);
+    stats->doorbells = atomic_load_explicit(&vcpu->doorbells, memory_order_relaxed);
+    stats->delivered = vcpu->delivered;
+    stats->unhandled = vcpu->unhandled;
+}
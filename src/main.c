@@ -1,11 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include "vm.h"
 #include "hook.h"
+#include "mmio.h"
+#include "hypercall.h"
+#include "metrics.h"
 #include "trap.h"
+#include "trace.h"
+#include "thread_pool.h"
 #include "util.h"
 
+#define REPLAY_THREADS 4
+#define DEFAULT_CPU_COUNT 1
+#define DEFAULT_MEMORY_SIZE (64ull * 1024 * 1024)
+
 static int running = 1;
 
 void handle_signal(int sig) {
@@ -15,7 +25,60 @@ void handle_signal(int sig) {
     }
 }
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--cpus <n>] [--dedup <pages-per-round>] [--record <trace>] [--replay <trace> [--fast]] [--snapshot <file>] [--restore <file>] [--metrics]\n", prog);
+}
+
+static int replay_trace(const char *path, trace_replay_mode_t mode) {
+    thread_pool_t *pool = thread_pool_create(REPLAY_THREADS);
+    if (!pool) {
+        log_error("Failed to create replay thread pool.");
+        return -1;
+    }
+
+    trace_replay_stats_t stats;
+    int result = trace_replay(path, pool, mode, &stats);
+
+    thread_pool_destroy(pool);
+    return result;
+}
+
 int main(int argc, char **argv) {
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    const char *snapshot_path = NULL;
+    const char *restore_path = NULL;
+    int export_metrics = 0;
+    trace_replay_mode_t replay_mode = TRACE_REPLAY_REALTIME;
+    vm_config_t config = {
+        .memory_size = DEFAULT_MEMORY_SIZE,
+        .cpu_count = DEFAULT_CPU_COUNT,
+        .overflow_policy = POOL_OVERFLOW_BLOCK
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+            config.cpu_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dedup") == 0 && i + 1 < argc) {
+            config.dedup_pages_per_round = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore_path = argv[++i];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            export_metrics = 1;
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            replay_mode = TRACE_REPLAY_FAST;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
     log_info("Starting Ghostvisor...");
 
     if (signal(SIGINT, handle_signal) == SIG_ERR || 
@@ -37,14 +100,72 @@ int main(int argc, char **argv) {
     }
     log_info("Hooking subsystem initialized.");
 
+    if (mmio_init() != 0) {
+        log_error("Failed to initialize MMIO device emulation.");
+        hook_cleanup();
+        vm_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    if (hypercall_init() != 0) {
+        log_error("Failed to initialize hypercalls.");
+        mmio_cleanup();
+        hook_cleanup();
+        vm_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    if (replay_path) {
+        int result = replay_trace(replay_path, replay_mode);
+        hypercall_cleanup();
+        mmio_cleanup();
+        hook_cleanup();
+        vm_cleanup();
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     if (trap_init() != 0) {
         log_error("Failed to initialize exception handling.");
+        hypercall_cleanup();
+        mmio_cleanup();
         hook_cleanup();
         vm_cleanup();
         return EXIT_FAILURE;
     }
     log_info("Exception handling subsystem initialized.");
 
+    trace_writer_t *tracer = NULL;
+    if (record_path) {
+        tracer = trace_writer_open(record_path, TRACE_DEFAULT_WINDOW_SIZE);
+        if (!tracer) {
+            log_error("Failed to open trap trace.");
+            trap_cleanup();
+            hypercall_cleanup();
+            mmio_cleanup();
+            hook_cleanup();
+            vm_cleanup();
+            return EXIT_FAILURE;
+        }
+        trap_set_trace_writer(tracer);
+    }
+
+    if (export_metrics && metrics_open(NULL, METRICS_DEFAULT_INTERVAL_MS) != 0) {
+        log_warn("Continuing without metrics export.");
+    }
+
+    int started = restore_path ? vm_restore(restore_path) : vm_start(&config);
+    if (started != 0) {
+        log_error("Failed to start VM.");
+        trap_cleanup();
+        trace_writer_close(tracer);
+        metrics_close();
+        hypercall_cleanup();
+        mmio_cleanup();
+        hook_cleanup();
+        vm_cleanup();
+        return EXIT_FAILURE;
+    }
+
     while (running) {
         if (vm_poll() != 0) {
             log_error("Error occurred while polling VM events.");
@@ -53,7 +174,16 @@ int main(int argc, char **argv) {
     }
 
     log_info("Shutting down Ghostvisor...");
+    if (snapshot_path && vm_snapshot(snapshot_path) != 0) {
+        log_error("Failed to write VM snapshot.");
+    }
+    vm_stop();
+    // The trap consumer records until it is joined, so the writer goes last.
     trap_cleanup();
+    trace_writer_close(tracer);
+    metrics_close();
+    hypercall_cleanup();
+    mmio_cleanup();
     hook_cleanup();
     vm_cleanup();
     log_info("Ghostvisor stopped cleanly.");
@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "memmap.h"
+#include "dedup.h"
+#include "util.h"
+
+#define MEMMAP_INITIAL_CAPACITY 64
+#define MEMMAP_DEDUP_FLAGS (MEMMAP_READ | MEMMAP_WRITE)
+
+// [start, end) with its protection. The table always covers the whole
+// guest region in address order and never holds two adjacent entries
+// with the same flags, so lookups are a binary search and every entry
+// is a maximal mapping.
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;
+} memmap_entry_t;
+
+// A piece of guest memory whose protection a batch changed.
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint32_t old_flags;
+    uint32_t new_flags;
+} memmap_change_t;
+
+typedef struct {
+    memmap_invalidate_func_t fn;
+    void *arg;
+} memmap_listener_t;
+
+typedef struct {
+    int initialized;
+    uint8_t *base;
+    uint64_t size;
+    uint64_t page_size;
+
+    memmap_entry_t *entries;
+    int count;
+    int capacity;
+
+    // Scratch kept across batches: the pre-batch table and the diff.
+    memmap_entry_t *prev;
+    int prev_capacity;
+    memmap_change_t *changes;
+    int changes_capacity;
+
+    memmap_listener_t listeners[MEMMAP_MAX_LISTENERS];
+    int listener_count;
+
+    memmap_stats_t stats;
+    pthread_rwlock_t lock;
+} memmap_state_t;
+
+static memmap_state_t memmap = {0};
+
+static int memmap_reserve(void **array, int *capacity, int needed, size_t size) {
+    if (needed <= *capacity) return 0;
+
+    int new_capacity = *capacity ? *capacity : MEMMAP_INITIAL_CAPACITY;
+    while (new_capacity < needed) new_capacity *= 2;
+
+    void *grown = realloc(*array, (size_t)new_capacity * size);
+    if (!grown) return -1;
+    *array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Index of the entry containing addr; addr must be inside the region.
+static int memmap_find(const memmap_entry_t *entries, int count, uint64_t addr) {
+    int lo = 0;
+    int hi = count - 1;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (entries[mid].start <= addr) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static int memmap_prot(uint32_t flags) {
+    int prot = PROT_NONE;
+    if (flags & MEMMAP_READ) prot |= PROT_READ;
+    if (flags & MEMMAP_WRITE) prot |= PROT_WRITE;
+    if (flags & MEMMAP_EXEC) prot |= PROT_EXEC;
+    return prot;
+}
+
+// Sets [start, end) to flags in the table, splitting the entries at either
+// edge and merging with neighbours that end up with the same flags.
+static int memmap_paint(uint64_t start, uint64_t end, uint32_t flags) {
+    if (memmap_reserve((void **)&memmap.entries, &memmap.capacity, memmap.count + 2,
+                       sizeof(memmap_entry_t)) != 0) {
+        return -1;
+    }
+
+    memmap_entry_t *entries = memmap.entries;
+    int first = memmap_find(entries, memmap.count, start);
+    int last = memmap_find(entries, memmap.count, end - 1);
+
+    memmap_entry_t pieces[3];
+    int n = 0;
+    if (entries[first].start < start) {
+        pieces[n++] = (memmap_entry_t){ entries[first].start, start, entries[first].flags };
+    }
+    pieces[n++] = (memmap_entry_t){ start, end, flags };
+    if (entries[last].end > end) {
+        pieces[n++] = (memmap_entry_t){ end, entries[last].end, entries[last].flags };
+    }
+
+    int replaced = last - first + 1;
+    memmove(&entries[first + n], &entries[last + 1],
+            (memmap.count - last - 1) * sizeof(memmap_entry_t));
+    memcpy(&entries[first], pieces, n * sizeof(memmap_entry_t));
+    memmap.count += n - replaced;
+
+    // Only the boundaries around the new pieces can have become mergeable.
+    int lo = first > 0 ? first - 1 : 0;
+    int hi = first + n < memmap.count ? first + n : memmap.count - 1;
+    for (int i = lo; i < hi && i + 1 < memmap.count;) {
+        if (entries[i].flags == entries[i + 1].flags) {
+            entries[i].end = entries[i + 1].end;
+            memmove(&entries[i + 1], &entries[i + 2],
+                    (memmap.count - i - 2) * sizeof(memmap_entry_t));
+            memmap.count--;
+            hi--;
+        } else {
+            i++;
+        }
+    }
+    return 0;
+}
+
+// Walks the pre- and post-batch tables together over [lo, hi) and records
+// every piece whose flags differ. Returns the number of changes or -1.
+static int memmap_diff(int prev_count, uint64_t lo, uint64_t hi) {
+    int n = 0;
+    int i = memmap_find(memmap.prev, prev_count, lo);
+    int j = memmap_find(memmap.entries, memmap.count, lo);
+    uint64_t cursor = lo;
+
+    while (cursor < hi) {
+        const memmap_entry_t *old = &memmap.prev[i];
+        const memmap_entry_t *cur = &memmap.entries[j];
+        uint64_t end = old->end < cur->end ? old->end : cur->end;
+        if (end > hi) end = hi;
+
+        if (old->flags != cur->flags) {
+            memmap_change_t *last = n ? &memmap.changes[n - 1] : NULL;
+            if (last && last->end == cursor && last->old_flags == old->flags &&
+                last->new_flags == cur->flags) {
+                last->end = end;
+            } else {
+                if (memmap_reserve((void **)&memmap.changes, &memmap.changes_capacity, n + 1,
+                                   sizeof(memmap_change_t)) != 0) {
+                    return -1;
+                }
+                memmap.changes[n++] = (memmap_change_t){ cursor, end, old->flags, cur->flags };
+            }
+        }
+
+        cursor = end;
+        if (old->end == end) i++;
+        if (cur->end == end) j++;
+    }
+    return n;
+}
+
+// Brings the host mapping of [start, end) to flags in one call. Unmapped
+// ranges are replaced with fresh anonymous memory rather than just
+// protected, so their contents are gone (and the pages freed) and a
+// later map starts from zeroes as the guest expects.
+static int memmap_host_apply(uint64_t start, uint64_t end, uint32_t flags) {
+    uint8_t *addr = memmap.base + start;
+    size_t len = end - start;
+
+    // Dedup freezes and thaws pages as read/write; keep it off anything else.
+    if (flags != MEMMAP_DEDUP_FLAGS && dedup_set_excluded(addr, len, 1) != 0) {
+        return -1;
+    }
+
+    int result;
+    if (flags == 0) {
+        void *fresh = mmap(addr, len, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        result = fresh == MAP_FAILED ? -1 : 0;
+    } else {
+        result = mprotect(addr, len, memmap_prot(flags));
+    }
+    memmap.stats.host_calls++;
+
+    if (result != 0) {
+        log_error("Failed to remap guest range 0x%llx-0x%llx: %s", start, end - 1, strerror(errno));
+        return -1;
+    }
+
+    if (flags == MEMMAP_DEDUP_FLAGS) {
+        dedup_set_excluded(addr, len, 0);
+    }
+
+    for (int i = 0; i < memmap.listener_count; i++) {
+        memmap.listeners[i].fn(start, end - 1, memmap.listeners[i].arg);
+    }
+    memmap.stats.invalidations++;
+    return 0;
+}
+
+static int memmap_validate(const memmap_range_t *request) {
+    if (request->size == 0 || request->addr % memmap.page_size != 0 ||
+        request->size % memmap.page_size != 0 || request->addr >= memmap.size ||
+        request->size > memmap.size - request->addr || (request->flags & ~MEMMAP_FLAGS_MASK)) {
+        log_error("Invalid guest mapping request: 0x%llx+0x%llx flags 0x%x",
+                  request->addr, request->size, request->flags);
+        return -1;
+    }
+    return 0;
+}
+
+int memmap_apply(const memmap_range_t *requests, size_t count) {
+    if (!memmap.initialized) {
+        log_error("Guest memory map not initialized.");
+        return -1;
+    }
+
+    if (!requests || count == 0 || count > MEMMAP_MAX_BATCH) {
+        log_error("Invalid guest mapping batch of %zu requests", count);
+        return -1;
+    }
+
+    uint64_t lo = UINT64_MAX;
+    uint64_t hi = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (memmap_validate(&requests[i]) != 0) {
+            return -1;
+        }
+        if (requests[i].addr < lo) lo = requests[i].addr;
+        if (requests[i].addr + requests[i].size > hi) hi = requests[i].addr + requests[i].size;
+    }
+
+    pthread_rwlock_wrlock(&memmap.lock);
+
+    if (memmap_reserve((void **)&memmap.prev, &memmap.prev_capacity, memmap.count,
+                       sizeof(memmap_entry_t)) != 0) {
+        pthread_rwlock_unlock(&memmap.lock);
+        return -1;
+    }
+    int prev_count = memmap.count;
+    memcpy(memmap.prev, memmap.entries, prev_count * sizeof(memmap_entry_t));
+
+    int changes = -1;
+    int painted = 1;
+    for (size_t i = 0; i < count && painted; i++) {
+        painted = memmap_paint(requests[i].addr, requests[i].addr + requests[i].size,
+                               requests[i].flags) == 0;
+    }
+    if (painted) {
+        changes = memmap_diff(prev_count, lo, hi);
+    }
+
+    if (changes < 0) {
+        log_error("Out of memory applying guest mapping batch");
+        memcpy(memmap.entries, memmap.prev, prev_count * sizeof(memmap_entry_t));
+        memmap.count = prev_count;
+        pthread_rwlock_unlock(&memmap.lock);
+        return -1;
+    }
+
+    // Changes are ordered and already merged per (old, new) pair; runs of
+    // them that are contiguous and share the new flags become one call.
+    int result = 0;
+    int run = 0;
+    for (int i = 1; i <= changes; i++) {
+        if (i < changes && memmap.changes[i].start == memmap.changes[i - 1].end &&
+            memmap.changes[i].new_flags == memmap.changes[run].new_flags) {
+            continue;
+        }
+        if (memmap_host_apply(memmap.changes[run].start, memmap.changes[i - 1].end,
+                              memmap.changes[run].new_flags) != 0) {
+            // Keep the table truthful: whatever wasn't applied keeps its old flags.
+            for (int k = run; k < changes; k++) {
+                memmap_paint(memmap.changes[k].start, memmap.changes[k].end,
+                             memmap.changes[k].old_flags);
+            }
+            result = -1;
+            break;
+        }
+        run = i;
+    }
+
+    memmap.stats.batches++;
+    memmap.stats.requests += count;
+    pthread_rwlock_unlock(&memmap.lock);
+    return result;
+}
+
+int memmap_lookup(uint64_t addr, memmap_range_t *range) {
+    if (!memmap.initialized || addr >= memmap.size || !range) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&memmap.lock);
+    const memmap_entry_t *entry = &memmap.entries[memmap_find(memmap.entries, memmap.count, addr)];
+    range->addr = entry->start;
+    range->size = entry->end - entry->start;
+    range->flags = entry->flags;
+    range->reserved = 0;
+    pthread_rwlock_unlock(&memmap.lock);
+    return 0;
+}
+
+int memmap_acquire(uint64_t addr, uint64_t len, uint32_t flags) {
+    if (!memmap.initialized || addr > memmap.size || len > memmap.size - addr) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&memmap.lock);
+    if (len == 0) {
+        return 0;
+    }
+
+    int i = memmap_find(memmap.entries, memmap.count, addr);
+    uint64_t end = addr + len;
+    for (; i < memmap.count && memmap.entries[i].start < end; i++) {
+        if ((memmap.entries[i].flags & flags) != flags) {
+            pthread_rwlock_unlock(&memmap.lock);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void memmap_release(void) {
+    pthread_rwlock_unlock(&memmap.lock);
+}
+
+int memmap_add_invalidate_listener(memmap_invalidate_func_t fn, void *arg) {
+    if (!memmap.initialized || !fn) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&memmap.lock);
+    if (memmap.listener_count == MEMMAP_MAX_LISTENERS) {
+        pthread_rwlock_unlock(&memmap.lock);
+        log_error("No free memory map listener slots");
+        return -1;
+    }
+    memmap.listeners[memmap.listener_count].fn = fn;
+    memmap.listeners[memmap.listener_count].arg = arg;
+    memmap.listener_count++;
+    pthread_rwlock_unlock(&memmap.lock);
+    return 0;
+}
+
+void memmap_get_stats(memmap_stats_t *stats) {
+    if (!stats) return;
+
+    pthread_rwlock_rdlock(&memmap.lock);
+    *stats = memmap.stats;
+    stats->ranges = memmap.count;
+    pthread_rwlock_unlock(&memmap.lock);
+}
+
+int memmap_init(uint8_t *base, uint64_t size, uint32_t flags) {
+    if (memmap.initialized) {
+        log_warn("Guest memory map already initialized.");
+        return 0;
+    }
+
+    memset(&memmap, 0, sizeof(memmap));
+    memmap.page_size = sysconf(_SC_PAGESIZE);
+
+    if (!base || size == 0 || size % memmap.page_size != 0 || (flags & ~MEMMAP_FLAGS_MASK)) {
+        log_error("Invalid guest memory map region");
+        return -1;
+    }
+
+    if (memmap_reserve((void **)&memmap.entries, &memmap.capacity, MEMMAP_INITIAL_CAPACITY,
+                       sizeof(memmap_entry_t)) != 0 ||
+        pthread_rwlock_init(&memmap.lock, NULL) != 0) {
+        log_error("Failed to allocate guest memory map");
+        free(memmap.entries);
+        memmap.entries = NULL;
+        return -1;
+    }
+
+    memmap.base = base;
+    memmap.size = size;
+    memmap.entries[0] = (memmap_entry_t){ 0, size, flags };
+    memmap.count = 1;
+    memmap.initialized = 1;
+    return 0;
+}
+
+void memmap_cleanup(void) {
+    if (!memmap.initialized) {
+        return;
+    }
+
+    if (memmap.stats.batches) {
+        log_info("Guest memory map: %llu batches, %llu requests, %llu host calls",
+                 memmap.stats.batches, memmap.stats.requests, memmap.stats.host_calls);
+    }
+
+    pthread_rwlock_destroy(&memmap.lock);
+    free(memmap.entries);
+    free(memmap.prev);
+    free(memmap.changes);
+    memset(&memmap, 0, sizeof(memmap));
+}
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "metrics.h"
+#include "hook.h"
+#include "dedup.h"
+#include "mmio.h"
+#include "hypercall.h"
+#include "util.h"
+
+_Static_assert(METRICS_LATENCY_BUCKETS == HOOK_LATENCY_BUCKETS, "latency buckets must match");
+_Static_assert(METRICS_MAX_HYPERCALLS >= MAX_HYPERCALL, "hypercall table too small");
+
+typedef struct {
+    metrics_segment_t *segment;
+    char name[64];
+    uint64_t last_publish_ns;
+} metrics_state_t;
+
+static metrics_state_t metrics = {0};
+
+static uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_record_trap(const trap_event_t *event) {
+    metrics_segment_t *segment = __atomic_load_n(&metrics.segment, __ATOMIC_ACQUIRE);
+    if (!segment) {
+        return;
+    }
+
+    if ((unsigned)event->type < METRICS_TRAP_TYPES) {
+        __atomic_fetch_add(&segment->traps[event->type], 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t index = __atomic_fetch_add(&segment->event_head, 1, __ATOMIC_RELAXED);
+    metrics_event_t *entry = &segment->events[index % METRICS_EVENT_RING_SIZE];
+
+    __atomic_store_n(&entry->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->time_ns = metrics_now_ns();
+    entry->type = event->type;
+    entry->address = event->address;
+    entry->data = event->data;
+    __atomic_store_n(&entry->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+static int metrics_copy_hook(const hook_handler_t *hook, void *arg) {
+    metrics_snapshot_t *snapshot = (metrics_snapshot_t *)arg;
+    if (snapshot->hook_count == METRICS_MAX_HOOKS) {
+        return 1;
+    }
+
+    metrics_hook_t *out = &snapshot->hooks[snapshot->hook_count++];
+    const hook_stats_t *stats = hook->stats;
+
+    out->type = hook->type;
+    out->id = hook->id;
+    out->region_start = hook->region_start;
+    out->region_end = hook->region_end;
+    memset(out->symbol, 0, sizeof(out->symbol));
+    if (hook->symbol) {
+        strncpy(out->symbol, hook->symbol, sizeof(out->symbol) - 1);
+    }
+
+    out->calls = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+    out->total_ns = __atomic_load_n(&stats->total_ns, __ATOMIC_RELAXED);
+    out->max_ns = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        out->buckets[i] = __atomic_load_n(&stats->buckets[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Gathers outside the seqlock into a private copy, so readers only ever
+// wait for the final memcpy.
+static void metrics_gather(metrics_snapshot_t *snapshot, thread_pool_t *pool) {
+    memset(snapshot, 0, sizeof(*snapshot));
+
+    if (pool) {
+        thread_pool_stats_t stats;
+        thread_pool_get_stats(pool, &stats);
+        snapshot->pool.submitted = stats.submitted;
+        snapshot->pool.processed = stats.processed;
+        snapshot->pool.dropped = stats.dropped_oldest + stats.dropped_class +
+                                 stats.dropped_sampled + stats.dropped_spill;
+        snapshot->pool.tasks = stats.tasks;
+        snapshot->pool.queue_depth = stats.queue_depth;
+        snapshot->pool.spill_depth = stats.spill_depth;
+    }
+
+    dedup_stats_t dedup;
+    dedup_get_stats(&dedup);
+    snapshot->dedup_pages_shared = dedup.pages_shared;
+    snapshot->dedup_bytes_saved = dedup.bytes_saved;
+
+    mmio_stats_t mmio;
+    mmio_get_stats(&mmio);
+    snapshot->mmio_accesses = mmio.accesses;
+    snapshot->mmio_cache_hits = mmio.cache_hits;
+
+    hook_for_each(metrics_copy_hook, snapshot);
+
+    for (int nr = 0; nr < MAX_HYPERCALL; nr++) {
+        hypercall_stats_t stats;
+        hypercall_get_stats(nr, &stats);
+        snapshot->hypercalls[nr].calls = stats.calls;
+        snapshot->hypercalls[nr].async_calls = stats.async_calls;
+        snapshot->hypercalls[nr].failures = stats.failures;
+        snapshot->hypercalls[nr].total_ns = stats.total_ns;
+        snapshot->hypercalls[nr].max_ns = stats.max_ns;
+    }
+}
+
+void metrics_publish(thread_pool_t *pool) {
+    metrics_segment_t *segment = metrics.segment;
+    if (!segment) {
+        return;
+    }
+
+    uint64_t now = metrics_now_ns();
+    if (now - metrics.last_publish_ns < segment->header.interval_ms * 1000000ull) {
+        return;
+    }
+    metrics.last_publish_ns = now;
+
+    static metrics_snapshot_t scratch;
+    metrics_gather(&scratch, pool);
+
+    metrics_header_t *header = &segment->header;
+    uint64_t seq = header->seq;
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&segment->snapshot, &scratch, sizeof(scratch));
+    header->updated_ns = now;
+    __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int metrics_open(const char *name, uint32_t interval_ms) {
+    if (metrics.segment) {
+        log_warn("Metrics segment already open.");
+        return 0;
+    }
+
+    if (name) {
+        snprintf(metrics.name, sizeof(metrics.name), "%s", name);
+    } else {
+        snprintf(metrics.name, sizeof(metrics.name), METRICS_SHM_PREFIX "%d", (int)getpid());
+    }
+
+    int fd = shm_open(metrics.name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Failed to create metrics segment %s: %s", metrics.name, strerror(errno));
+        return -1;
+    }
+
+    metrics_segment_t *segment = MAP_FAILED;
+    if (ftruncate(fd, sizeof(metrics_segment_t)) == 0) {
+        segment = mmap(NULL, sizeof(metrics_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (segment == MAP_FAILED) {
+        log_error("Failed to map metrics segment %s: %s", metrics.name, strerror(errno));
+        shm_unlink(metrics.name);
+        return -1;
+    }
+
+    // The segment is zero-filled; magic goes in last so a reader never
+    // sees a valid header over a half-initialized segment.
+    segment->header.version = METRICS_VERSION;
+    segment->header.size = sizeof(metrics_segment_t);
+    segment->header.pid = getpid();
+    segment->header.interval_ms = interval_ms ? interval_ms : METRICS_DEFAULT_INTERVAL_MS;
+    segment->header.start_ns = metrics_now_ns();
+    __atomic_store_n(&segment->header.magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+
+    metrics.last_publish_ns = 0;
+    __atomic_store_n(&metrics.segment, segment, __ATOMIC_RELEASE);
+    hook_set_timing(1);
+
+    log_info("Publishing metrics to /dev/shm%s", metrics.name);
+    return 0;
+}
+
+void metrics_close(void) {
+    metrics_segment_t *segment = metrics.segment;
+    if (!segment) {
+        return;
+    }
+
+    hook_set_timing(0);
+    __atomic_store_n(&metrics.segment, NULL, __ATOMIC_RELEASE);
+    shm_unlink(metrics.name);
+    munmap(segment, sizeof(metrics_segment_t));
+}
@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mmio.h"
+#include "hook.h"
+#include "scan.h"
+#include "util.h"
+
+// A decoded access: the device and register a (guest address, syndrome)
+// pair resolved to last time. Entries are only trusted while their
+// generation matches the global one, so invalidation is a single bump.
+typedef struct {
+    uint64_t address;
+    uint64_t syndrome;
+    uint64_t generation;
+    mmio_device_t *device;
+    const mmio_register_t *reg;
+    uint64_t offset;
+    unsigned width;
+    int write;
+} mmio_decode_t;
+
+typedef struct {
+    int initialized;
+    // Same packed layout as the hook tables: lookups only walk bases/ends.
+    uint64_t bases[MMIO_MAX_DEVICES];
+    uint64_t ends[MMIO_MAX_DEVICES];
+    mmio_device_t *devices[MMIO_MAX_DEVICES];
+    int count;
+    uint64_t generation;
+    mmio_stats_t stats;
+    pthread_mutex_t lock;
+} mmio_state_t;
+
+static mmio_state_t mmio = {0};
+
+// Only the trap consumer uses it; the hook path decodes without it.
+static mmio_decode_t mmio_cache[MMIO_CACHE_SIZE];
+
+static void mmio_count(uint64_t *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+static size_t mmio_cache_slot(uint64_t address, uint64_t syndrome) {
+    uint64_t h = (address ^ (syndrome << 7)) * 0x9e3779b97f4a7c15ull;
+    return (h >> 32) & (MMIO_CACHE_SIZE - 1);
+}
+
+static const mmio_register_t *mmio_find_register(const mmio_device_t *dev, uint64_t offset) {
+    for (size_t i = 0; i < dev->reg_count; i++) {
+        const mmio_register_t *reg = &dev->regs[i];
+        if (offset >= reg->offset && offset < reg->offset + reg->width) {
+            return reg;
+        }
+    }
+    return NULL;
+}
+
+// Slow path: find the device and register for an access and fill in a
+// decode entry. Misses are cached too (device == NULL), so RAM faults
+// that reach here repeatedly don't rescan the device table.
+static void mmio_decode(uint64_t address, uint64_t syndrome, mmio_decode_t *decode) {
+    int count = __atomic_load_n(&mmio.count, __ATOMIC_ACQUIRE);
+    size_t index = scan_find_range(mmio.bases, mmio.ends, count, address);
+
+    decode->address = address;
+    decode->syndrome = syndrome;
+    decode->device = NULL;
+    if (index == SCAN_NOT_FOUND) {
+        return;
+    }
+
+    mmio_device_t *dev = mmio.devices[index];
+    decode->device = dev;
+    decode->offset = address - dev->base;
+    decode->reg = mmio_find_register(dev, decode->offset);
+    decode->width = 1u << ((syndrome >> TRAP_MEM_SAS_SHIFT) & TRAP_MEM_SAS_MASK);
+    decode->write = (syndrome & TRAP_MEM_WNR) != 0;
+}
+
+static void mmio_emulate(const mmio_decode_t *decode, trap_event_t *event) {
+    mmio_device_t *dev = decode->device;
+    const mmio_register_t *reg = decode->reg;
+
+    if (decode->write) {
+        mmio_write_func_t write = reg ? reg->write : dev->write;
+        uint64_t offset = reg ? decode->offset - reg->offset : decode->offset;
+        mmio_count(&dev->stats.writes);
+        if (write) {
+            write(dev, offset, event->value, decode->width);
+        } else if (!reg) {
+            mmio_count(&dev->stats.unhandled);
+        }
+        return;
+    }
+
+    mmio_read_func_t read = reg ? reg->read : dev->read;
+    uint64_t offset = reg ? decode->offset - reg->offset : decode->offset;
+    mmio_count(&dev->stats.reads);
+    event->value = 0;
+    if (read) {
+        event->value = read(dev, offset, decode->width);
+    } else if (!reg) {
+        mmio_count(&dev->stats.unhandled);
+    }
+}
+
+int mmio_handle_access(trap_event_t *event) {
+    if (!mmio.initialized || !event || event->type != TRAP_MEMORY) {
+        return 0;
+    }
+
+    uint64_t syndrome = event->data;
+    if (!(syndrome & TRAP_MEM_ISV)) {
+        int count = __atomic_load_n(&mmio.count, __ATOMIC_ACQUIRE);
+        if (scan_find_range(mmio.bases, mmio.ends, count, event->address) != SCAN_NOT_FOUND) {
+            mmio_count(&mmio.stats.undecoded);
+        }
+        return 0;
+    }
+
+    uint64_t generation = __atomic_load_n(&mmio.generation, __ATOMIC_ACQUIRE);
+    mmio_decode_t *decode = &mmio_cache[mmio_cache_slot(event->address, syndrome)];
+
+    if (decode->generation == generation && decode->address == event->address &&
+        decode->syndrome == syndrome) {
+        mmio_count(&mmio.stats.cache_hits);
+    } else {
+        mmio_count(&mmio.stats.cache_misses);
+        mmio_decode(event->address, syndrome, decode);
+        decode->generation = generation;
+    }
+
+    if (!decode->device) {
+        return 0;
+    }
+
+    mmio_count(&mmio.stats.accesses);
+    mmio_emulate(decode, event);
+    return 1;
+}
+
+// Generic hook path: replayed traces, and live faults the fast path
+// couldn't emulate (those are undecoded, and skipped). Only writes are
+// meaningful: there is no vCPU waiting on a read result, and calling a
+// read callback here would throw away whatever it consumed (read-to-clear
+// status, FIFO data).
+static int mmio_hook_handler(const trap_event_t *event) {
+    if (!(event->data & TRAP_MEM_ISV) || !(event->data & TRAP_MEM_WNR)) {
+        return 0;
+    }
+
+    mmio_decode_t decode;
+    mmio_decode(event->address, event->data, &decode);
+    if (decode.device) {
+        trap_event_t copy = *event;
+        mmio_count(&mmio.stats.accesses);
+        mmio_emulate(&decode, &copy);
+    }
+    return 0;
+}
+
+int mmio_register_device(mmio_device_t *dev) {
+    if (!mmio.initialized) {
+        log_error("MMIO subsystem not initialized.");
+        return -1;
+    }
+
+    if (!dev || dev->size == 0 || dev->base + dev->size < dev->base ||
+        (!dev->regs && dev->reg_count)) {
+        log_error("Invalid MMIO device");
+        return -1;
+    }
+
+    uint64_t end = dev->base + dev->size - 1;
+
+    pthread_mutex_lock(&mmio.lock);
+    if (mmio.count == MMIO_MAX_DEVICES) {
+        pthread_mutex_unlock(&mmio.lock);
+        log_error("No free MMIO device slots for %s", dev->name);
+        return -1;
+    }
+
+    for (int i = 0; i < mmio.count; i++) {
+        if (dev->base <= mmio.ends[i] && end >= mmio.bases[i]) {
+            pthread_mutex_unlock(&mmio.lock);
+            log_error("MMIO device %s overlaps %s", dev->name, mmio.devices[i]->name);
+            return -1;
+        }
+    }
+
+    if (register_hook(HOOK_TYPE_MEMORY, 0, dev->base, end, mmio_hook_handler) != 0) {
+        pthread_mutex_unlock(&mmio.lock);
+        return -1;
+    }
+
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    int i = mmio.count;
+    mmio.bases[i] = dev->base;
+    mmio.ends[i] = end;
+    mmio.devices[i] = dev;
+    __atomic_store_n(&mmio.count, i + 1, __ATOMIC_RELEASE);
+    // Cached misses for this range must not outlive the new device.
+    __atomic_add_fetch(&mmio.generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mmio.lock);
+
+    log_info("Registered MMIO device %s at 0x%llx-0x%llx", dev->name ? dev->name : "?",
+             dev->base, end);
+    return 0;
+}
+
+size_t mmio_device_windows(memmap_range_t *ranges, size_t max, uint64_t page_size) {
+    int count = __atomic_load_n(&mmio.count, __ATOMIC_ACQUIRE);
+    size_t n = 0;
+
+    for (int i = 0; i < count && n < max; i++) {
+        uint64_t start = mmio.bases[i] & ~(page_size - 1);
+        uint64_t end = (mmio.ends[i] | (page_size - 1)) + 1;
+        ranges[n++] = (memmap_range_t){ .addr = start, .size = end - start, .flags = 0 };
+    }
+    return n;
+}
+
+void mmio_invalidate(uint64_t start, uint64_t end) {
+    int count = __atomic_load_n(&mmio.count, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < count; i++) {
+        if (start <= mmio.ends[i] && end >= mmio.bases[i]) {
+            __atomic_add_fetch(&mmio.generation, 1, __ATOMIC_RELEASE);
+            mmio_count(&mmio.stats.invalidations);
+            return;
+        }
+    }
+}
+
+void mmio_get_stats(mmio_stats_t *stats) {
+    if (!stats) return;
+
+    stats->accesses = __atomic_load_n(&mmio.stats.accesses, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&mmio.stats.cache_hits, __ATOMIC_RELAXED);
+    stats->cache_misses = __atomic_load_n(&mmio.stats.cache_misses, __ATOMIC_RELAXED);
+    stats->undecoded = __atomic_load_n(&mmio.stats.undecoded, __ATOMIC_RELAXED);
+    stats->invalidations = __atomic_load_n(&mmio.stats.invalidations, __ATOMIC_RELAXED);
+}
+
+int mmio_init(void) {
+    if (mmio.initialized) {
+        log_warn("MMIO subsystem already initialized.");
+        return 0;
+    }
+
+    memset(&mmio, 0, sizeof(mmio));
+    if (pthread_mutex_init(&mmio.lock, NULL) != 0) {
+        log_error("Failed to initialize MMIO mutex");
+        return -1;
+    }
+
+    // Generation 0 marks an empty cache slot.
+    mmio.generation = 1;
+    mmio.initialized = 1;
+    return 0;
+}
+
+void mmio_cleanup(void) {
+    if (!mmio.initialized) {
+        return;
+    }
+
+    if (mmio.stats.accesses) {
+        log_info("MMIO: %llu accesses, %llu decode cache hits, %llu misses",
+                 mmio.stats.accesses, mmio.stats.cache_hits, mmio.stats.cache_misses);
+    }
+
+    pthread_mutex_destroy(&mmio.lock);
+    mmio.count = 0;
+    mmio.initialized = 0;
+}
@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "scan.h"
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_HAVE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_HAVE_NEON 1
+#endif
+
+typedef struct {
+    const char *name;
+    size_t (*find_u64)(const uint64_t *keys, size_t count, uint64_t key);
+    size_t (*find_range)(const uint64_t *starts, const uint64_t *ends, size_t count, uint64_t key);
+    const uint8_t *(*find_byte)(const uint8_t *buf, size_t len, uint8_t byte);
+    // First i < len - gap with buf[i] == first && buf[i + gap] == last.
+    const uint8_t *(*find_pair)(const uint8_t *buf, size_t len, uint8_t first, uint8_t last,
+                                size_t gap);
+} scan_kernels_t;
+
+/* Scalar kernels */
+
+static size_t scalar_find_u64(const uint64_t *keys, size_t count, uint64_t key) {
+    for (size_t i = 0; i < count; i++) {
+        if (keys[i] == key) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+static size_t scalar_find_range(const uint64_t *starts, const uint64_t *ends, size_t count,
+                                uint64_t key) {
+    for (size_t i = 0; i < count; i++) {
+        if (key >= starts[i] && key <= ends[i]) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+static const uint8_t *scalar_find_byte(const uint8_t *buf, size_t len, uint8_t byte) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] == byte) return buf + i;
+    }
+    return NULL;
+}
+
+static const uint8_t *scalar_find_pair(const uint8_t *buf, size_t len, uint8_t first,
+                                       uint8_t last, size_t gap) {
+    for (size_t i = 0; i + gap < len; i++) {
+        if (buf[i] == first && buf[i + gap] == last) return buf + i;
+    }
+    return NULL;
+}
+
+static const scan_kernels_t scalar_kernels = {
+    "scalar", scalar_find_u64, scalar_find_range, scalar_find_byte, scalar_find_pair
+};
+
+#ifdef SCAN_HAVE_X86
+
+/* SSE4.2 kernels (_mm_cmpgt_epi64 is the SSE4.2 piece) */
+
+__attribute__((target("sse4.2")))
+static size_t sse42_find_u64(const uint64_t *keys, size_t count, uint64_t key) {
+    __m128i needle = _mm_set1_epi64x((long long)key);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(keys + i));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(v, needle)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < count; i++) {
+        if (keys[i] == key) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_find_range(const uint64_t *starts, const uint64_t *ends, size_t count,
+                               uint64_t key) {
+    // Signed compares only: flip the sign bit to order unsigned values.
+    __m128i sign = _mm_set1_epi64x((long long)0x8000000000000000ull);
+    __m128i k = _mm_xor_si128(_mm_set1_epi64x((long long)key), sign);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i s = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(starts + i)), sign);
+        __m128i e = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(ends + i)), sign);
+        __m128i outside = _mm_or_si128(_mm_cmpgt_epi64(s, k), _mm_cmpgt_epi64(k, e));
+        int mask = ~_mm_movemask_pd(_mm_castsi128_pd(outside)) & 0x3;
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < count; i++) {
+        if (key >= starts[i] && key <= ends[i]) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+__attribute__((target("sse4.2")))
+static const uint8_t *sse42_find_byte(const uint8_t *buf, size_t len, uint8_t byte) {
+    __m128i needle = _mm_set1_epi8((char)byte);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask) return buf + i + __builtin_ctz(mask);
+    }
+    return scalar_find_byte(buf + i, len - i, byte);
+}
+
+__attribute__((target("sse4.2")))
+static const uint8_t *sse42_find_pair(const uint8_t *buf, size_t len, uint8_t first,
+                                      uint8_t last, size_t gap) {
+    if (len <= gap) return NULL;
+
+    __m128i vf = _mm_set1_epi8((char)first);
+    __m128i vl = _mm_set1_epi8((char)last);
+    size_t n = len - gap;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + gap));
+        int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, vf), _mm_cmpeq_epi8(b, vl)));
+        if (mask) return buf + i + __builtin_ctz(mask);
+    }
+    return scalar_find_pair(buf + i, len - i, first, last, gap);
+}
+
+static const scan_kernels_t sse42_kernels = {
+    "sse4.2", sse42_find_u64, sse42_find_range, sse42_find_byte, sse42_find_pair
+};
+
+/* AVX2 kernels */
+
+__attribute__((target("avx2")))
+static size_t avx2_find_u64(const uint64_t *keys, size_t count, uint64_t key) {
+    __m256i needle = _mm256_set1_epi64x((long long)key);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(keys + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(keys + i + 4));
+        int ma = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, needle)));
+        int mb = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(b, needle)));
+        int mask = ma | (mb << 4);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < count; i++) {
+        if (keys[i] == key) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_range(const uint64_t *starts, const uint64_t *ends, size_t count,
+                              uint64_t key) {
+    __m256i sign = _mm256_set1_epi64x((long long)0x8000000000000000ull);
+    __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), sign);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i s = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(starts + i)), sign);
+        __m256i e = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(ends + i)), sign);
+        __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi64(s, k), _mm256_cmpgt_epi64(k, e));
+        int mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xf;
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    for (; i < count; i++) {
+        if (key >= starts[i] && key <= ends[i]) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *avx2_find_byte(const uint8_t *buf, size_t len, uint8_t byte) {
+    __m256i needle = _mm256_set1_epi8((char)byte);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), needle);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 32)), needle);
+        if (!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            uint64_t mask = (uint32_t)_mm256_movemask_epi8(a) |
+                            ((uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32);
+            return buf + i + __builtin_ctzll(mask);
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask) return buf + i + __builtin_ctz(mask);
+    }
+    return scalar_find_byte(buf + i, len - i, byte);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *avx2_find_pair(const uint8_t *buf, size_t len, uint8_t first,
+                                     uint8_t last, size_t gap) {
+    if (len <= gap) return NULL;
+
+    __m256i vf = _mm256_set1_epi8((char)first);
+    __m256i vl = _mm256_set1_epi8((char)last);
+    size_t n = len - gap;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + gap));
+        uint32_t mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, vf), _mm256_cmpeq_epi8(b, vl)));
+        if (mask) return buf + i + __builtin_ctz(mask);
+    }
+    return scalar_find_pair(buf + i, len - i, first, last, gap);
+}
+
+static const scan_kernels_t avx2_kernels = {
+    "avx2", avx2_find_u64, avx2_find_range, avx2_find_byte, avx2_find_pair
+};
+
+#endif // SCAN_HAVE_X86
+
+#ifdef SCAN_HAVE_NEON
+
+/* NEON kernels (always present on aarch64) */
+
+// NEON has no movemask; narrowing each 16-bit lane by 4 leaves one nibble
+// per input byte in a 64-bit scalar.
+static inline uint64_t neon_byte_mask(uint8x16_t eq) {
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+static size_t neon_find_u64(const uint64_t *keys, size_t count, uint64_t key) {
+    uint64x2_t needle = vdupq_n_u64(key);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64(keys + i), needle);
+        if (vgetq_lane_u64(eq, 0)) return i;
+        if (vgetq_lane_u64(eq, 1)) return i + 1;
+    }
+    for (; i < count; i++) {
+        if (keys[i] == key) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+static size_t neon_find_range(const uint64_t *starts, const uint64_t *ends, size_t count,
+                              uint64_t key) {
+    uint64x2_t k = vdupq_n_u64(key);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        uint64x2_t in = vandq_u64(vcgeq_u64(k, vld1q_u64(starts + i)),
+                                  vcleq_u64(k, vld1q_u64(ends + i)));
+        if (vgetq_lane_u64(in, 0)) return i;
+        if (vgetq_lane_u64(in, 1)) return i + 1;
+    }
+    for (; i < count; i++) {
+        if (key >= starts[i] && key <= ends[i]) return i;
+    }
+    return SCAN_NOT_FOUND;
+}
+
+static const uint8_t *neon_find_byte(const uint8_t *buf, size_t len, uint8_t byte) {
+    uint8x16_t needle = vdupq_n_u8(byte);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint64_t mask = neon_byte_mask(vceqq_u8(vld1q_u8(buf + i), needle));
+        if (mask) return buf + i + (__builtin_ctzll(mask) >> 2);
+    }
+    return scalar_find_byte(buf + i, len - i, byte);
+}
+
+static const uint8_t *neon_find_pair(const uint8_t *buf, size_t len, uint8_t first,
+                                     uint8_t last, size_t gap) {
+    if (len <= gap) return NULL;
+
+    uint8x16_t vf = vdupq_n_u8(first);
+    uint8x16_t vl = vdupq_n_u8(last);
+    size_t n = len - gap;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(buf + i), vf),
+                                 vceqq_u8(vld1q_u8(buf + i + gap), vl));
+        uint64_t mask = neon_byte_mask(eq);
+        if (mask) return buf + i + (__builtin_ctzll(mask) >> 2);
+    }
+    return scalar_find_pair(buf + i, len - i, first, last, gap);
+}
+
+static const scan_kernels_t neon_kernels = {
+    "neon", neon_find_u64, neon_find_range, neon_find_byte, neon_find_pair
+};
+
+#endif // SCAN_HAVE_NEON
+
+static const scan_kernels_t *kernels = &scalar_kernels;
+
+static const scan_kernels_t *scan_best_kernels(void) {
+#if defined(SCAN_HAVE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+    if (__builtin_cpu_supports("sse4.2")) return &sse42_kernels;
+#elif defined(SCAN_HAVE_NEON)
+    return &neon_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+static const scan_kernels_t *scan_select(scan_impl_t impl) {
+    const scan_kernels_t *best = scan_best_kernels();
+    const scan_kernels_t *selected = NULL;
+
+    switch (impl) {
+        case SCAN_IMPL_AUTO:
+            selected = best;
+            break;
+        case SCAN_IMPL_SCALAR:
+            selected = &scalar_kernels;
+            break;
+#if defined(SCAN_HAVE_X86)
+        case SCAN_IMPL_SSE42:
+            if (best == &avx2_kernels || best == &sse42_kernels) selected = &sse42_kernels;
+            break;
+        case SCAN_IMPL_AVX2:
+            if (best == &avx2_kernels) selected = &avx2_kernels;
+            break;
+#elif defined(SCAN_HAVE_NEON)
+        case SCAN_IMPL_NEON:
+            selected = &neon_kernels;
+            break;
+#endif
+        default:
+            break;
+    }
+    return selected;
+}
+
+int scan_impl_supported(scan_impl_t impl) {
+    return scan_select(impl) != NULL;
+}
+
+int scan_init(scan_impl_t impl) {
+    const scan_kernels_t *selected = scan_select(impl);
+    if (!selected) {
+        log_error("Scan implementation %d is not supported on this CPU", impl);
+        return -1;
+    }
+
+    kernels = selected;
+    log_debug("Using %s scan kernels", kernels->name);
+    return 0;
+}
+
+const char *scan_impl_name(void) {
+    return kernels->name;
+}
+
+size_t scan_find_u64(const uint64_t *keys, size_t count, uint64_t key) {
+    return kernels->find_u64(keys, count, key);
+}
+
+size_t scan_find_range(const uint64_t *starts, const uint64_t *ends, size_t count, uint64_t key) {
+    return kernels->find_range(starts, ends, count, key);
+}
+
+const void *scan_memchr(const void *buf, size_t len, uint8_t byte) {
+    return kernels->find_byte(buf, len, byte);
+}
+
+const void *scan_memmem(const void *haystack, size_t haystack_len,
+                        const void *needle, size_t needle_len) {
+    return scan_pattern(haystack, haystack_len, needle, NULL, needle_len);
+}
+
+static int scan_pattern_matches(const uint8_t *start, const uint8_t *pattern,
+                                const uint8_t *mask, size_t pattern_len) {
+    for (size_t i = 0; i < pattern_len; i++) {
+        if ((start[i] ^ pattern[i]) & (mask ? mask[i] : 0xff)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// No byte is fully fixed, so there is nothing to anchor on: compare at
+// every offset.
+static const void *scan_pattern_unanchored(const uint8_t *data, size_t len, const uint8_t *pattern,
+                                           const uint8_t *mask, size_t pattern_len) {
+    for (size_t pos = 0; pos + pattern_len <= len; pos++) {
+        if (scan_pattern_matches(data + pos, pattern, mask, pattern_len)) {
+            return data + pos;
+        }
+    }
+    return NULL;
+}
+
+const void *scan_pattern(const void *buf, size_t len, const uint8_t *pattern,
+                         const uint8_t *mask, size_t pattern_len) {
+    const uint8_t *data = buf;
+
+    if (pattern_len == 0) return buf;
+    if (pattern_len > len) return NULL;
+
+    // Anchor on the first and last fully fixed (0xff) bytes; the vector
+    // kernels test both at once and only candidates that pass get a full
+    // compare. Partially masked bytes are only checked by that compare.
+    size_t first = 0;
+    size_t last = pattern_len - 1;
+    if (mask) {
+        while (first < pattern_len && mask[first] != 0xff) first++;
+        if (first == pattern_len) {
+            return scan_pattern_unanchored(data, len, pattern, mask, pattern_len);
+        }
+        while (mask[last] != 0xff) last--;
+    }
+
+    size_t gap = last - first;
+    size_t pos = first;
+    size_t end = len - (pattern_len - 1 - last);
+
+    while (pos < end) {
+        const uint8_t *hit;
+        if (gap == 0) {
+            hit = kernels->find_byte(data + pos, end - pos, pattern[first]);
+        } else {
+            hit = kernels->find_pair(data + pos, end - pos, pattern[first], pattern[last], gap);
+        }
+        if (!hit) return NULL;
+
+        const uint8_t *start = hit - first;
+        if (scan_pattern_matches(start, pattern, mask, pattern_len)) {
+            return start;
+        }
+
+        pos = (size_t)(hit - data) + 1;
+    }
+
+    return NULL;
+}
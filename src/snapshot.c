@@ -0,0 +1,873 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "compress.h"
+#include "hook.h"
+#include "irq.h"
+#include "util.h"
+
+typedef enum {
+    CHUNK_ZERO,
+    CHUNK_RAW,
+    CHUNK_COMPRESSED
+} snapshot_chunk_kind_t;
+
+typedef enum {
+    CHUNK_RESIDENT,
+    CHUNK_PENDING
+} snapshot_chunk_state_t;
+
+// On-disk layout: header, registration records, page-aligned chunk data in
+// guest address order, then the chunk table. The table and header are
+// written last so the data can be streamed as workers finish it.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t memory_size;
+    uint32_t page_size;
+    uint32_t chunk_size;
+    uint64_t chunk_count;
+    uint64_t table_offset;
+    uint64_t registrations_offset;
+    uint64_t registrations_size;
+    uint32_t hook_count;
+    uint32_t irq_count;
+    int32_t cpu_count;
+    int32_t trap_workers;
+    int32_t trap_queue_size;
+    int32_t overflow_policy;
+    uint32_t dedup_pages_per_round;
+    uint32_t dedup_interval_ms;
+} snapshot_header_t;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t kind;
+} snapshot_chunk_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t path_len;
+    uint32_t symbol_len;
+    uint32_t reserved;
+    uint64_t id;
+    uint64_t region_start;
+    uint64_t region_end;
+} snapshot_hook_record_t;
+
+typedef struct {
+    uint32_t irq;
+    uint32_t reserved;
+    uint64_t handler;
+} snapshot_irq_record_t;
+
+struct snapshot {
+    int fd;
+    const uint8_t *file;
+    size_t file_size;
+    const snapshot_header_t *header;
+    const snapshot_chunk_t *chunks;
+
+    uint8_t *memory;
+    _Atomic uint8_t *state;
+    snapshot_restore_stats_t stats;
+    pthread_mutex_t lock;
+
+    pthread_t prefetch_thread;
+    int prefetching;
+    atomic_int stop;
+};
+
+// ---- writer ----
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_BUSY,
+    SLOT_READY
+} snapshot_slot_state_t;
+
+typedef struct {
+    snapshot_slot_state_t state;
+    snapshot_chunk_kind_t kind;
+    uint32_t size;
+    uint8_t *data;
+    const uint8_t *raw;     // chunk contents as they go into the file
+    uint8_t *copy;          // readable pages of a partly protected chunk
+} snapshot_slot_t;
+
+// Workers claim chunks in order but may finish out of order; each chunk
+// owns slot (index % slot_count) until the writer has flushed it, which
+// bounds how far compression can run ahead of the file.
+typedef struct {
+    const snapshot_source_t *source;
+    uint32_t chunk_size;
+    uint32_t page_size;
+    uint64_t chunk_count;
+    snapshot_slot_t *slots;
+    uint64_t slot_count;
+    uint64_t next_chunk;
+    uint64_t flushed;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} snapshot_job_t;
+
+static uint64_t snapshot_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t snapshot_align(uint64_t value, uint64_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+static uint64_t snapshot_chunk_len(uint64_t memory_size, uint32_t chunk_size, uint64_t index) {
+    uint64_t offset = index * chunk_size;
+    uint64_t left = memory_size - offset;
+    return left < chunk_size ? left : chunk_size;
+}
+
+static int snapshot_is_zero(const uint8_t *data, size_t len) {
+    const uint64_t *words = (const uint64_t *)data;
+    for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+        if (words[i]) return 0;
+    }
+    return 1;
+}
+
+static void snapshot_encode_chunk(snapshot_job_t *job, uint64_t index, snapshot_slot_t *slot) {
+    const snapshot_source_t *source = job->source;
+    uint64_t offset = index * job->chunk_size;
+    const uint8_t *data = source->memory + offset;
+    size_t len = snapshot_chunk_len(source->memory_size, job->chunk_size, index);
+
+    if (source->readable) {
+        // Gather into the slot so protected pages are never dereferenced.
+        int partial = 0;
+        for (size_t page = 0; page < len; page += job->page_size) {
+            size_t n = len - page < job->page_size ? len - page : job->page_size;
+            if (source->readable(offset + page, source->readable_arg)) {
+                memcpy(slot->copy + page, data + page, n);
+            } else {
+                memset(slot->copy + page, 0, n);
+                partial = 1;
+            }
+        }
+        if (partial) {
+            data = slot->copy;
+        }
+    }
+    slot->raw = data;
+
+    if (snapshot_is_zero(data, len)) {
+        slot->kind = CHUNK_ZERO;
+        slot->size = 0;
+        return;
+    }
+
+    // Anything that doesn't shrink by at least an eighth is stored raw:
+    // raw chunks restore with a plain mmap and no decompression at all.
+    size_t size = compress_block(data, len, slot->data, len - len / 8);
+    if (size) {
+        slot->kind = CHUNK_COMPRESSED;
+        slot->size = size;
+    } else {
+        slot->kind = CHUNK_RAW;
+        slot->size = len;
+    }
+}
+
+static void *snapshot_worker(void *arg) {
+    snapshot_job_t *job = (snapshot_job_t *)arg;
+
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->failed && job->next_chunk < job->chunk_count &&
+               job->next_chunk >= job->flushed + job->slot_count) {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (job->failed || job->next_chunk == job->chunk_count) {
+            break;
+        }
+
+        uint64_t index = job->next_chunk++;
+        snapshot_slot_t *slot = &job->slots[index % job->slot_count];
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&job->lock);
+
+        snapshot_encode_chunk(job, index, slot);
+
+        pthread_mutex_lock(&job->lock);
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&job->changed);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+static int snapshot_write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int snapshot_pad_to(int fd, uint64_t *offset, uint64_t target) {
+    static const uint8_t zeros[4096];
+    while (*offset < target) {
+        size_t n = target - *offset < sizeof(zeros) ? target - *offset : sizeof(zeros);
+        if (snapshot_write_all(fd, zeros, n) != 0) return -1;
+        *offset += n;
+    }
+    return 0;
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t capacity;
+    uint32_t hooks;
+    uint32_t skipped;
+} snapshot_buffer_t;
+
+static int snapshot_buffer_put(snapshot_buffer_t *b, const void *data, size_t len) {
+    if (b->size + len > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 4096;
+        while (capacity < b->size + len) capacity *= 2;
+        uint8_t *buf = realloc(b->buf, capacity);
+        if (!buf) return -1;
+        b->buf = buf;
+        b->capacity = capacity;
+    }
+    memcpy(b->buf + b->size, data, len);
+    b->size += len;
+    return 0;
+}
+
+static int snapshot_record_hook(const hook_handler_t *hook, void *arg) {
+    snapshot_buffer_t *b = (snapshot_buffer_t *)arg;
+
+    // Handlers registered by pointer can't be resolved in another process.
+    if (!hook->lib_path || !hook->symbol) {
+        b->skipped++;
+        return 0;
+    }
+
+    snapshot_hook_record_t record = {
+        .type = hook->type,
+        .path_len = strlen(hook->lib_path),
+        .symbol_len = strlen(hook->symbol),
+        .id = hook->id,
+        .region_start = hook->region_start,
+        .region_end = hook->region_end
+    };
+    if (snapshot_buffer_put(b, &record, sizeof(record)) != 0 ||
+        snapshot_buffer_put(b, hook->lib_path, record.path_len) != 0 ||
+        snapshot_buffer_put(b, hook->symbol, record.symbol_len) != 0) {
+        return -1;
+    }
+    b->hooks++;
+    return 0;
+}
+
+static int snapshot_record_registrations(snapshot_buffer_t *b, uint32_t *irq_count) {
+    if (hook_for_each(snapshot_record_hook, b) != 0) {
+        return -1;
+    }
+
+    *irq_count = 0;
+    for (uint32_t irq = 0; irq < IRQ_MAX; irq++) {
+        snapshot_irq_record_t record = { .irq = irq, .handler = irq_get_handler(irq) };
+        if (!record.handler) continue;
+        if (snapshot_buffer_put(b, &record, sizeof(record)) != 0) return -1;
+        (*irq_count)++;
+    }
+    return 0;
+}
+
+static int snapshot_stream_chunks(int fd, snapshot_job_t *job, snapshot_chunk_t *table,
+                                  uint64_t *offset, uint32_t page_size,
+                                  snapshot_stats_t *stats) {
+    for (uint64_t i = 0; i < job->chunk_count; i++) {
+        snapshot_slot_t *slot = &job->slots[i % job->slot_count];
+
+        pthread_mutex_lock(&job->lock);
+        while (slot->state != SLOT_READY) {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        int result = 0;
+        table[i].kind = slot->kind;
+        table[i].size = slot->size;
+        table[i].offset = 0;
+
+        if (slot->kind == CHUNK_RAW) {
+            // Raw chunks must sit on page boundaries to be mmap'able.
+            result = snapshot_pad_to(fd, offset, snapshot_align(*offset, page_size));
+            table[i].offset = *offset;
+            if (result == 0) {
+                result = snapshot_write_all(fd, slot->raw, slot->size);
+            }
+            stats->raw_chunks++;
+        } else if (slot->kind == CHUNK_COMPRESSED) {
+            table[i].offset = *offset;
+            result = snapshot_write_all(fd, slot->data, slot->size);
+            stats->compressed_chunks++;
+        } else {
+            stats->zero_chunks++;
+        }
+        *offset += slot->size;
+
+        pthread_mutex_lock(&job->lock);
+        slot->state = SLOT_FREE;
+        job->flushed++;
+        if (result != 0) {
+            job->failed = 1;
+        }
+        pthread_cond_broadcast(&job->changed);
+        pthread_mutex_unlock(&job->lock);
+
+        if (result != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int snapshot_write(const char *path, const snapshot_source_t *source, int workers,
+                   snapshot_stats_t *stats) {
+    if (!path || !source || !source->memory || !source->config) {
+        log_error("Invalid snapshot request");
+        return -1;
+    }
+
+    snapshot_stats_t local_stats;
+    if (!stats) stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+
+    uint64_t started = snapshot_now_ns();
+    uint32_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workers <= 0) workers = 1;
+    if (workers > SNAPSHOT_MAX_WORKERS) workers = SNAPSHOT_MAX_WORKERS;
+
+    snapshot_buffer_t registrations = {0};
+    uint32_t irq_count = 0;
+    if (snapshot_record_registrations(&registrations, &irq_count) != 0) {
+        log_error("Failed to record hook and IRQ registrations");
+        free(registrations.buf);
+        return -1;
+    }
+    if (registrations.skipped) {
+        log_warn("Snapshot skips %u hooks registered without a library symbol.",
+                 registrations.skipped);
+    }
+
+    const vm_config_t *config = source->config;
+    snapshot_header_t header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .memory_size = source->memory_size,
+        .page_size = page_size,
+        .chunk_size = SNAPSHOT_CHUNK_SIZE,
+        .chunk_count = (source->memory_size + SNAPSHOT_CHUNK_SIZE - 1) / SNAPSHOT_CHUNK_SIZE,
+        .registrations_offset = sizeof(snapshot_header_t),
+        .registrations_size = registrations.size,
+        .hook_count = registrations.hooks,
+        .irq_count = irq_count,
+        .cpu_count = config->cpu_count,
+        .trap_workers = config->trap_workers,
+        .trap_queue_size = config->trap_queue_size,
+        .overflow_policy = config->overflow_policy,
+        .dedup_pages_per_round = config->dedup_pages_per_round,
+        .dedup_interval_ms = config->dedup_interval_ms
+    };
+
+    snapshot_job_t job = {
+        .source = source,
+        .chunk_size = SNAPSHOT_CHUNK_SIZE,
+        .page_size = page_size,
+        .chunk_count = header.chunk_count,
+        .slot_count = (uint64_t)workers * 2
+    };
+    snapshot_chunk_t *table = calloc(header.chunk_count ? header.chunk_count : 1,
+                                     sizeof(snapshot_chunk_t));
+    job.slots = calloc(job.slot_count, sizeof(snapshot_slot_t));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    int result = -1;
+    int fd = -1;
+    int started_workers = 0;
+
+    if (!table || !job.slots || !threads) {
+        log_error("Failed to allocate snapshot state");
+        goto out;
+    }
+    for (uint64_t i = 0; i < job.slot_count; i++) {
+        job.slots[i].data = malloc(SNAPSHOT_CHUNK_SIZE);
+        if (source->readable) {
+            job.slots[i].copy = malloc(SNAPSHOT_CHUNK_SIZE);
+        }
+        if (!job.slots[i].data || (source->readable && !job.slots[i].copy)) {
+            log_error("Failed to allocate snapshot buffers");
+            goto out;
+        }
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("Failed to create snapshot %s: %s", path, strerror(errno));
+        goto out;
+    }
+
+    uint64_t offset = 0;
+    if (snapshot_write_all(fd, &header, sizeof(header)) != 0 ||
+        snapshot_write_all(fd, registrations.buf, registrations.size) != 0) {
+        log_error("Failed to write snapshot header: %s", strerror(errno));
+        goto out;
+    }
+    offset = sizeof(header) + registrations.size;
+
+    if (pthread_mutex_init(&job.lock, NULL) != 0) goto out;
+    if (pthread_cond_init(&job.changed, NULL) != 0) {
+        pthread_mutex_destroy(&job.lock);
+        goto out;
+    }
+
+    for (; started_workers < workers; started_workers++) {
+        if (pthread_create(&threads[started_workers], NULL, snapshot_worker, &job) != 0) {
+            break;
+        }
+    }
+
+    if (started_workers == 0) {
+        log_error("Failed to start snapshot workers");
+    } else if (snapshot_stream_chunks(fd, &job, table, &offset, page_size, stats) != 0) {
+        log_error("Failed to write snapshot data: %s", strerror(errno));
+    } else {
+        header.table_offset = snapshot_align(offset, sizeof(uint64_t));
+        if (snapshot_pad_to(fd, &offset, header.table_offset) != 0 ||
+            snapshot_write_all(fd, table, header.chunk_count * sizeof(snapshot_chunk_t)) != 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            fdatasync(fd) != 0) {
+            log_error("Failed to finish snapshot: %s", strerror(errno));
+        } else {
+            offset += header.chunk_count * sizeof(snapshot_chunk_t);
+            result = 0;
+        }
+    }
+
+    pthread_mutex_lock(&job.lock);
+    job.failed = 1;
+    pthread_cond_broadcast(&job.changed);
+    pthread_mutex_unlock(&job.lock);
+    for (int i = 0; i < started_workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+
+out:
+    if (fd >= 0) {
+        close(fd);
+        if (result != 0) unlink(path);
+    }
+    if (job.slots) {
+        for (uint64_t i = 0; i < job.slot_count; i++) {
+            free(job.slots[i].data);
+            free(job.slots[i].copy);
+        }
+    }
+    free(job.slots);
+    free(threads);
+    free(table);
+    free(registrations.buf);
+
+    if (result == 0) {
+        stats->chunks = header.chunk_count;
+        stats->hooks = registrations.hooks;
+        stats->hooks_skipped = registrations.skipped;
+        stats->irqs = irq_count;
+        stats->bytes_in = source->memory_size;
+        stats->bytes_out = offset;
+        stats->elapsed_ns = snapshot_now_ns() - started;
+        log_info("Snapshot %s: %llu chunks (%llu zero, %llu raw, %llu compressed), "
+                 "%llu -> %llu bytes in %llu ms",
+                 path, stats->chunks, stats->zero_chunks, stats->raw_chunks,
+                 stats->compressed_chunks, stats->bytes_in, stats->bytes_out,
+                 stats->elapsed_ns / 1000000);
+    }
+    return result;
+}
+
+// ---- restore ----
+
+static int snapshot_validate(snapshot_t *snap) {
+    const snapshot_header_t *h = snap->header;
+
+    if (snap->file_size < sizeof(*h) || h->magic != SNAPSHOT_MAGIC) {
+        log_error("Not a snapshot file");
+        return -1;
+    }
+    if (h->version != SNAPSHOT_VERSION) {
+        log_error("Unsupported snapshot version %u", h->version);
+        return -1;
+    }
+    if (h->page_size != (uint32_t)sysconf(_SC_PAGESIZE) || h->chunk_size == 0 ||
+        h->chunk_size % h->page_size != 0 || h->memory_size % h->page_size != 0) {
+        log_error("Snapshot page geometry doesn't match this host");
+        return -1;
+    }
+    if (h->chunk_count != (h->memory_size + h->chunk_size - 1) / h->chunk_size ||
+        h->table_offset % sizeof(uint64_t) != 0 || h->table_offset > snap->file_size ||
+        h->chunk_count > (snap->file_size - h->table_offset) / sizeof(snapshot_chunk_t) ||
+        h->registrations_offset > snap->file_size ||
+        h->registrations_size > snap->file_size - h->registrations_offset) {
+        log_error("Snapshot tables are truncated or corrupt");
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < h->chunk_count; i++) {
+        const snapshot_chunk_t *chunk = &snap->chunks[i];
+        uint64_t len = snapshot_chunk_len(h->memory_size, h->chunk_size, i);
+        if (chunk->kind > CHUNK_COMPRESSED || chunk->offset > snap->file_size ||
+            chunk->size > snap->file_size - chunk->offset ||
+            (chunk->kind == CHUNK_RAW &&
+             (chunk->size != len || chunk->offset % h->page_size != 0))) {
+            log_error("Snapshot chunk %llu is corrupt", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+snapshot_t *snapshot_open(const char *path) {
+    snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+    if (!snap) return NULL;
+
+    snap->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (snap->fd < 0) {
+        log_error("Failed to open snapshot %s: %s", path, strerror(errno));
+        free(snap);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(snap->fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header_t)) {
+        log_error("Snapshot %s is too short", path);
+        close(snap->fd);
+        free(snap);
+        return NULL;
+    }
+
+    snap->file_size = st.st_size;
+    snap->file = mmap(NULL, snap->file_size, PROT_READ, MAP_PRIVATE, snap->fd, 0);
+    if (snap->file == MAP_FAILED) {
+        log_error("Failed to map snapshot %s: %s", path, strerror(errno));
+        close(snap->fd);
+        free(snap);
+        return NULL;
+    }
+
+    snap->header = (const snapshot_header_t *)snap->file;
+    snap->chunks = (const snapshot_chunk_t *)(snap->file + snap->header->table_offset);
+
+    if (snapshot_validate(snap) != 0 || pthread_mutex_init(&snap->lock, NULL) != 0) {
+        munmap((void *)snap->file, snap->file_size);
+        close(snap->fd);
+        free(snap);
+        return NULL;
+    }
+
+    log_info("Opened snapshot %s: %llu bytes of guest memory, %d vCPUs",
+             path, snap->header->memory_size, snap->header->cpu_count);
+    return snap;
+}
+
+void snapshot_get_config(snapshot_t *snap, vm_config_t *config) {
+    const snapshot_header_t *h = snap->header;
+
+    memset(config, 0, sizeof(*config));
+    config->memory_size = h->memory_size;
+    config->cpu_count = h->cpu_count;
+    config->trap_workers = h->trap_workers;
+    config->trap_queue_size = h->trap_queue_size;
+    config->overflow_policy = (pool_overflow_policy_t)h->overflow_policy;
+    config->dedup_pages_per_round = h->dedup_pages_per_round;
+    config->dedup_interval_ms = h->dedup_interval_ms;
+}
+
+uint64_t snapshot_memory_size(snapshot_t *snap) {
+    return snap->header->memory_size;
+}
+
+// Maps a run of consecutive chunks of the same kind in one call; raw
+// chunks are contiguous in the file, so a run is one file mapping.
+static int snapshot_map_run(snapshot_t *snap, uint64_t first, uint64_t last) {
+    const snapshot_header_t *h = snap->header;
+    const snapshot_chunk_t *chunk = &snap->chunks[first];
+    uint64_t offset = first * h->chunk_size;
+    uint64_t len = 0;
+
+    for (uint64_t i = first; i <= last; i++) {
+        len += snapshot_chunk_len(h->memory_size, h->chunk_size, i);
+    }
+
+    if (chunk->kind == CHUNK_RAW) {
+        void *mapped = mmap(snap->memory + offset, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_FIXED, snap->fd, chunk->offset);
+        return mapped == MAP_FAILED ? -1 : 0;
+    }
+    if (chunk->kind == CHUNK_COMPRESSED) {
+        for (uint64_t i = first; i <= last; i++) {
+            atomic_store_explicit(&snap->state[i], CHUNK_PENDING, memory_order_relaxed);
+        }
+        snap->stats.lazy_chunks += last - first + 1;
+        return mprotect(snap->memory + offset, len, PROT_NONE);
+    }
+    return 0;
+}
+
+static int snapshot_joins_run(snapshot_t *snap, uint64_t prev, uint64_t next) {
+    const snapshot_chunk_t *a = &snap->chunks[prev];
+    const snapshot_chunk_t *b = &snap->chunks[next];
+
+    if (a->kind != b->kind) return 0;
+    if (a->kind != CHUNK_RAW) return 1;
+    return a->offset + a->size == b->offset;
+}
+
+int snapshot_map_memory(snapshot_t *snap, uint8_t *memory, uint64_t size) {
+    const snapshot_header_t *h = snap->header;
+
+    if (size != h->memory_size) {
+        log_error("Guest memory size 0x%llx doesn't match snapshot 0x%llx",
+                  size, h->memory_size);
+        return -1;
+    }
+
+    snap->state = calloc(h->chunk_count ? h->chunk_count : 1, sizeof(*snap->state));
+    if (!snap->state) {
+        log_error("Failed to allocate snapshot chunk state");
+        return -1;
+    }
+    snap->memory = memory;
+
+    uint64_t first = 0;
+    for (uint64_t i = 1; i <= h->chunk_count; i++) {
+        if (i < h->chunk_count && snapshot_joins_run(snap, i - 1, i)) {
+            continue;
+        }
+        if (snapshot_map_run(snap, first, i - 1) != 0) {
+            log_error("Failed to map snapshot chunks %llu-%llu: %s", first, i - 1, strerror(errno));
+            return -1;
+        }
+        first = i;
+    }
+
+    log_info("Mapped snapshot memory: %llu of %llu chunks left to decompress on demand.",
+             snap->stats.lazy_chunks, h->chunk_count);
+    return 0;
+}
+
+// Decompresses into a private mapping and swaps it in with mremap, so no
+// vCPU can observe a half-filled chunk through the guest mapping.
+static int snapshot_fill_chunk(snapshot_t *snap, uint64_t index, int faulted) {
+    const snapshot_header_t *h = snap->header;
+    const snapshot_chunk_t *chunk = &snap->chunks[index];
+    uint64_t len = snapshot_chunk_len(h->memory_size, h->chunk_size, index);
+    int result = 0;
+
+    pthread_mutex_lock(&snap->lock);
+    if (atomic_load_explicit(&snap->state[index], memory_order_acquire) != CHUNK_PENDING) {
+        pthread_mutex_unlock(&snap->lock);
+        return 0;
+    }
+
+    void *fill = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fill == MAP_FAILED) {
+        log_error("Failed to allocate snapshot fill buffer: %s", strerror(errno));
+        pthread_mutex_unlock(&snap->lock);
+        return -1;
+    }
+
+    if (decompress_block(snap->file + chunk->offset, chunk->size, fill, len) != (long)len) {
+        log_error("Snapshot chunk %llu failed to decompress", index);
+        munmap(fill, len);
+        result = -1;
+    } else if (mremap(fill, len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+                      snap->memory + index * h->chunk_size) == MAP_FAILED) {
+        log_error("Failed to install snapshot chunk %llu: %s", index, strerror(errno));
+        munmap(fill, len);
+        result = -1;
+    } else {
+        atomic_store_explicit(&snap->state[index], CHUNK_RESIDENT, memory_order_release);
+        if (faulted) {
+            snap->stats.faulted++;
+        } else {
+            snap->stats.prefetched++;
+        }
+        result = 1;
+    }
+
+    pthread_mutex_unlock(&snap->lock);
+    return result;
+}
+
+int snapshot_fault_in(snapshot_t *snap, void *addr) {
+    if (!snap || !snap->state) return 0;
+
+    uint8_t *p = (uint8_t *)addr;
+    if (p < snap->memory || p >= snap->memory + snap->header->memory_size) {
+        return 0;
+    }
+
+    uint64_t index = (p - snap->memory) / snap->header->chunk_size;
+    if (atomic_load_explicit(&snap->state[index], memory_order_acquire) != CHUNK_PENDING) {
+        return 0;
+    }
+
+    // Lost the race with the prefetcher: the chunk is there now either way.
+    return snapshot_fill_chunk(snap, index, 1) < 0 ? -1 : 1;
+}
+
+int snapshot_make_resident(snapshot_t *snap, uint64_t offset, uint64_t len) {
+    if (!snap || !snap->state || len == 0) return 0;
+
+    const snapshot_header_t *h = snap->header;
+    if (offset >= h->memory_size) return 0;
+    if (len > h->memory_size - offset) len = h->memory_size - offset;
+
+    uint64_t last = (offset + len - 1) / h->chunk_size;
+    for (uint64_t i = offset / h->chunk_size; i <= last; i++) {
+        if (snapshot_fill_chunk(snap, i, 1) < 0) return -1;
+    }
+    return 0;
+}
+
+static void *snapshot_prefetch_thread(void *arg) {
+    snapshot_t *snap = (snapshot_t *)arg;
+    uint64_t started = snapshot_now_ns();
+
+    for (uint64_t i = 0; i < snap->header->chunk_count; i++) {
+        if (atomic_load_explicit(&snap->stop, memory_order_relaxed)) {
+            return NULL;
+        }
+        if (snapshot_fill_chunk(snap, i, 0) < 0) {
+            log_warn("Snapshot prefetch stopped at chunk %llu; remaining chunks fill on demand.", i);
+            return NULL;
+        }
+    }
+
+    log_info("Snapshot restore complete: %llu chunks prefetched, %llu faulted in, %llu ms.",
+             snap->stats.prefetched, snap->stats.faulted,
+             (snapshot_now_ns() - started) / 1000000);
+    return NULL;
+}
+
+int snapshot_start_prefetch(snapshot_t *snap) {
+    if (!snap || !snap->state || snap->prefetching) return -1;
+    if (snap->stats.lazy_chunks == 0) return 0;
+
+    atomic_store(&snap->stop, 0);
+    if (pthread_create(&snap->prefetch_thread, NULL, snapshot_prefetch_thread, snap) != 0) {
+        log_warn("Failed to start snapshot prefetch; chunks fill on demand only.");
+        return -1;
+    }
+    snap->prefetching = 1;
+    return 0;
+}
+
+int snapshot_restore_registrations(snapshot_t *snap) {
+    const snapshot_header_t *h = snap->header;
+    const uint8_t *p = snap->file + h->registrations_offset;
+    const uint8_t *end = p + h->registrations_size;
+    char path[4096];
+    char symbol[256];
+
+    for (uint32_t i = 0; i < h->hook_count; i++) {
+        snapshot_hook_record_t record;
+        if ((size_t)(end - p) < sizeof(record)) goto corrupt;
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+
+        if (record.path_len >= sizeof(path) || record.symbol_len >= sizeof(symbol) ||
+            (size_t)(end - p) < (size_t)record.path_len + record.symbol_len) {
+            goto corrupt;
+        }
+        memcpy(path, p, record.path_len);
+        path[record.path_len] = '\0';
+        p += record.path_len;
+        memcpy(symbol, p, record.symbol_len);
+        symbol[record.symbol_len] = '\0';
+        p += record.symbol_len;
+
+        if (register_dynamic_hook(path, symbol, (hook_type_t)record.type, record.id,
+                                  record.region_start, record.region_end) != 0) {
+            log_error("Failed to restore hook %s:%s", path, symbol);
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < h->irq_count; i++) {
+        snapshot_irq_record_t record;
+        if ((size_t)(end - p) < sizeof(record)) goto corrupt;
+        memcpy(&record, p, sizeof(record));
+        p += sizeof(record);
+
+        if (irq_register_handler(record.irq, record.handler) != 0) {
+            return -1;
+        }
+    }
+
+    log_info("Restored %u hooks and %u IRQ handlers from snapshot.", h->hook_count, h->irq_count);
+    return 0;
+
+corrupt:
+    log_error("Snapshot registration records are corrupt");
+    return -1;
+}
+
+void snapshot_get_restore_stats(snapshot_t *snap, snapshot_restore_stats_t *stats) {
+    if (!snap || !stats) return;
+
+    pthread_mutex_lock(&snap->lock);
+    *stats = snap->stats;
+    pthread_mutex_unlock(&snap->lock);
+}
+
+void snapshot_close(snapshot_t *snap) {
+    if (!snap) return;
+
+    if (snap->prefetching) {
+        atomic_store(&snap->stop, 1);
+        pthread_join(snap->prefetch_thread, NULL);
+    }
+
+    pthread_mutex_destroy(&snap->lock);
+    free(snap->state);
+    munmap((void *)snap->file, snap->file_size);
+    close(snap->fd);
+    free(snap);
+}
@@ -3,22 +3,30 @@
 #include <string.h>
 #include <pthread.h>
 #include "thread_pool.h"
+#include "arena.h"
 #include "hook.h"
 #include "util.h"
 
-#define MAX_QUEUE_SIZE 1024
+#define WORK_RECORD_ALIGN 64
 
+// The ring holds pointers to event records carved from a slab sized for
+// every slot plus one in-flight record per worker, so submitting and
+// draining never touch malloc. Records are cache-line aligned so a worker
+// handling one never shares a line with the producer filling the next.
 typedef struct {
-    trap_event_t event;
-    int valid;
-} work_item_t;
-
-typedef struct {
-    work_item_t *queue;
+    trap_event_t **queue;
+    slab_t records;
     int head;
     int tail;
     int count;
     int size;
+    trap_event_t *spill;
+    int spill_head;
+    int spill_tail;
+    int spill_count;
+    int spill_size;
+    pool_task_t *tasks_head;
+    pool_task_t *tasks_tail;
     pthread_mutex_t lock;
     pthread_cond_t not_empty;
     pthread_cond_t not_full;
@@ -28,24 +36,50 @@ typedef struct {
 struct thread_pool {
     pthread_t *threads;
     int num_threads;
+    pool_overflow_policy_t policy;
+    uint32_t drop_class_mask;
+    uint32_t sample_rate;
+    uint32_t sample_counter;
+    thread_pool_stats_t stats;
     work_queue_t queue;
 };
 
-static work_queue_t *work_queue_create(int size) {
+static work_queue_t *work_queue_create(int size, int spill_size, int num_threads) {
     work_queue_t *queue = calloc(1, sizeof(work_queue_t));
     if (!queue) return NULL;
 
-    queue->queue = calloc(size, sizeof(work_item_t));
+    queue->queue = calloc(size, sizeof(trap_event_t *));
     if (!queue->queue) {
         free(queue);
         return NULL;
     }
 
+    if (slab_init(&queue->records, sizeof(trap_event_t), WORK_RECORD_ALIGN,
+                  size + num_threads) != 0) {
+        free(queue->queue);
+        free(queue);
+        return NULL;
+    }
+
+    if (spill_size > 0) {
+        queue->spill = calloc(spill_size, sizeof(trap_event_t));
+        if (!queue->spill) {
+            slab_destroy(&queue->records);
+            free(queue->queue);
+            free(queue);
+            return NULL;
+        }
+    }
+
     queue->size = size;
     queue->head = queue->tail = queue->count = 0;
+    queue->spill_size = spill_size;
+    queue->spill_head = queue->spill_tail = queue->spill_count = 0;
     queue->shutdown = 0;
 
     if (pthread_mutex_init(&queue->lock, NULL) != 0) {
+        free(queue->spill);
+        slab_destroy(&queue->records);
         free(queue->queue);
         free(queue);
         return NULL;
@@ -54,6 +88,8 @@ static work_queue_t *work_queue_create(int size) {
     if (pthread_cond_init(&queue->not_empty, NULL) != 0 ||
         pthread_cond_init(&queue->not_full, NULL) != 0) {
         pthread_mutex_destroy(&queue->lock);
+        free(queue->spill);
+        slab_destroy(&queue->records);
         free(queue->queue);
         free(queue);
         return NULL;
@@ -67,67 +103,162 @@ static void work_queue_destroy(work_queue_t *queue) {
     pthread_mutex_destroy(&queue->lock);
     pthread_cond_destroy(&queue->not_empty);
     pthread_cond_destroy(&queue->not_full);
+    free(queue->spill);
+    slab_destroy(&queue->records);
     free(queue->queue);
-    free(queue);
+}
+
+// Caller holds queue->lock and has checked there is room, which also
+// guarantees a free record.
+static void work_queue_push(work_queue_t *queue, const trap_event_t *event) {
+    trap_event_t *record = slab_alloc(&queue->records);
+    *record = *event;
+    record->scratch = NULL;
+    queue->queue[queue->tail] = record;
+
+    queue->tail = (queue->tail + 1) % queue->size;
+    queue->count++;
+}
+
+static void work_queue_drop_oldest(work_queue_t *queue) {
+    slab_free(&queue->records, queue->queue[queue->head]);
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+}
+
+static void work_queue_spill(work_queue_t *queue, const trap_event_t *event) {
+    queue->spill[queue->spill_tail] = *event;
+    queue->spill_tail = (queue->spill_tail + 1) % queue->spill_size;
+    queue->spill_count++;
+}
+
+// Spilled events are always newer than anything in the main ring, so
+// moving them to the tail keeps delivery in submission order.
+static void work_queue_refill_from_spill(work_queue_t *queue) {
+    while (queue->spill_count > 0 && queue->count < queue->size) {
+        work_queue_push(queue, &queue->spill[queue->spill_head]);
+        queue->spill_head = (queue->spill_head + 1) % queue->spill_size;
+        queue->spill_count--;
+    }
 }
 
 static void *worker_thread(void *arg) {
     thread_pool_t *pool = (thread_pool_t *)arg;
     work_queue_t *queue = &pool->queue;
+    arena_t *scratch = arena_thread_scratch();
+    trap_event_t *done = NULL;
+
+    if (!scratch) {
+        log_warn("Trap worker running without a scratch arena");
+    }
 
     while (1) {
         pthread_mutex_lock(&queue->lock);
 
-        while (queue->count == 0 && !queue->shutdown) {
+        // The previous record goes back under the lock we take anyway.
+        if (done) {
+            slab_free(&queue->records, done);
+            done = NULL;
+        }
+
+        while (queue->count == 0 && !queue->tasks_head && !queue->shutdown) {
             pthread_cond_wait(&queue->not_empty, &queue->lock);
         }
 
+        if (queue->tasks_head) {
+            pool_task_t *task = queue->tasks_head;
+            queue->tasks_head = task->next;
+            if (!queue->tasks_head) {
+                queue->tasks_tail = NULL;
+            }
+            pthread_mutex_unlock(&queue->lock);
+
+            task->fn(task, task->arg);
+            arena_reset(scratch);
+            continue;
+        }
+
         if (queue->shutdown && queue->count == 0) {
             pthread_mutex_unlock(&queue->lock);
             pthread_exit(NULL);
         }
 
         // Get work item
-        work_item_t item = queue->queue[queue->head];
+        trap_event_t *event = queue->queue[queue->head];
         queue->head = (queue->head + 1) % queue->size;
         queue->count--;
+        pool->stats.processed++;
+
+        work_queue_refill_from_spill(queue);
 
         pthread_cond_signal(&queue->not_full);
         pthread_mutex_unlock(&queue->lock);
 
-        if (item.valid) {
-            // Process trap event based on type
-            switch (item.event.type) {
-                case TRAP_SYSCALL:
-                    handle_syscall(&item.event);
-                    break;
-                case TRAP_MEMORY:
-                    handle_memory_access(&item.event);
-                    break;
-                case TRAP_EXCEPTION:
-                    handle_exception(&item.event);
-                    break;
-                default:
-                    log_error("Unknown trap type: %d", item.event.type);
-            }
+        event->scratch = scratch;
+
+        // Process trap event based on type
+        switch (event->type) {
+            case TRAP_SYSCALL:
+                handle_syscall(event);
+                break;
+            case TRAP_MEMORY:
+                handle_memory_access(event);
+                break;
+            case TRAP_EXCEPTION:
+                handle_exception(event);
+                break;
+            default:
+                log_error("Unknown trap type: %d", event->type);
         }
+
+        arena_reset(scratch);
+        done = event;
     }
 
     return NULL;
 }
 
 thread_pool_t *thread_pool_create(int num_threads) {
+    thread_pool_config_t config = {
+        .num_threads = num_threads,
+        .queue_size = THREAD_POOL_DEFAULT_QUEUE_SIZE,
+        .policy = POOL_OVERFLOW_BLOCK
+    };
+    return thread_pool_create_with_config(&config);
+}
+
+thread_pool_t *thread_pool_create_with_config(const thread_pool_config_t *config) {
+    if (!config || config->num_threads <= 0 || config->queue_size <= 0) {
+        log_error("Invalid thread pool configuration");
+        return NULL;
+    }
+
+    if (config->policy == POOL_OVERFLOW_SAMPLE && config->sample_rate == 0) {
+        log_error("Sampling overflow policy requires a non-zero sample rate");
+        return NULL;
+    }
+
+    if (config->policy == POOL_OVERFLOW_SPILL && config->spill_size <= 0) {
+        log_error("Spill overflow policy requires a non-zero spill size");
+        return NULL;
+    }
+
+    int num_threads = config->num_threads;
     thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
     if (!pool) return NULL;
 
     pool->num_threads = num_threads;
+    pool->policy = config->policy;
+    pool->drop_class_mask = config->drop_class_mask;
+    pool->sample_rate = config->sample_rate;
     pool->threads = calloc(num_threads, sizeof(pthread_t));
     if (!pool->threads) {
         free(pool);
         return NULL;
     }
 
-    work_queue_t *queue = work_queue_create(MAX_QUEUE_SIZE);
+    int spill_size = config->policy == POOL_OVERFLOW_SPILL ? config->spill_size : 0;
+    work_queue_t *queue = work_queue_create(config->queue_size, spill_size, num_threads);
     if (!queue) {
         free(pool->threads);
         free(pool);
@@ -153,8 +284,49 @@ int thread_pool_submit(thread_pool_t *pool, trap_event_t *event) {
     work_queue_t *queue = &pool->queue;
     pthread_mutex_lock(&queue->lock);
 
+    if (queue->shutdown) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    pool->stats.submitted++;
+
+    // Once anything is parked in the spill ring, new events must queue
+    // behind it or they would overtake older ones.
+    if (pool->policy == POOL_OVERFLOW_SPILL && queue->spill_count > 0) {
+        goto spill;
+    }
+
     while (queue->count == queue->size && !queue->shutdown) {
-        pthread_cond_wait(&queue->not_full, &queue->lock);
+        switch (pool->policy) {
+            case POOL_OVERFLOW_DROP_OLDEST:
+                work_queue_drop_oldest(queue);
+                pool->stats.dropped_oldest++;
+                break;
+            case POOL_OVERFLOW_DROP_CLASS:
+                if (pool->drop_class_mask & (1u << event->type)) {
+                    pool->stats.dropped_class++;
+                    pthread_mutex_unlock(&queue->lock);
+                    return 1;
+                }
+                pthread_cond_wait(&queue->not_full, &queue->lock);
+                break;
+            case POOL_OVERFLOW_SAMPLE:
+                if (++pool->sample_counter % pool->sample_rate != 0) {
+                    pool->stats.dropped_sampled++;
+                    pthread_mutex_unlock(&queue->lock);
+                    return 1;
+                }
+                work_queue_drop_oldest(queue);
+                pool->stats.dropped_oldest++;
+                break;
+            case POOL_OVERFLOW_SPILL:
+                goto spill;
+            case POOL_OVERFLOW_BLOCK:
+            default:
+                pthread_cond_wait(&queue->not_full, &queue->lock);
+                break;
+        }
     }
 
     if (queue->shutdown) {
@@ -162,17 +334,67 @@ int thread_pool_submit(thread_pool_t *pool, trap_event_t *event) {
         return -1;
     }
 
-    work_item_t *item = &queue->queue[queue->tail];
-    item->event = *event;
-    item->valid = 1;
-
-    queue->tail = (queue->tail + 1) % queue->size;
-    queue->count++;
+    work_queue_push(queue, event);
 
     pthread_cond_signal(&queue->not_empty);
     pthread_mutex_unlock(&queue->lock);
 
     return 0;
+
+spill:
+    if (queue->spill_count == queue->spill_size) {
+        pool->stats.dropped_spill++;
+        pthread_mutex_unlock(&queue->lock);
+        return 1;
+    }
+
+    work_queue_spill(queue, event);
+    pool->stats.spilled++;
+    pthread_mutex_unlock(&queue->lock);
+
+    return 0;
+}
+
+void pool_task_init(pool_task_t *task, pool_task_func_t fn, void *arg) {
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+}
+
+int thread_pool_submit_task(thread_pool_t *pool, pool_task_t *task) {
+    if (!pool || !task || !task->fn) return -1;
+
+    work_queue_t *queue = &pool->queue;
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->shutdown) {
+        pthread_mutex_unlock(&queue->lock);
+        return -1;
+    }
+
+    task->next = NULL;
+    if (queue->tasks_tail) {
+        queue->tasks_tail->next = task;
+    } else {
+        queue->tasks_head = task;
+    }
+    queue->tasks_tail = task;
+    pool->stats.tasks++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+void thread_pool_get_stats(thread_pool_t *pool, thread_pool_stats_t *stats) {
+    if (!pool || !stats) return;
+
+    work_queue_t *queue = &pool->queue;
+    pthread_mutex_lock(&queue->lock);
+    *stats = pool->stats;
+    stats->queue_depth = queue->count;
+    stats->spill_depth = queue->spill_count;
+    pthread_mutex_unlock(&queue->lock);
 }
 
 void thread_pool_destroy(thread_pool_t *pool) {
@@ -188,6 +410,14 @@ void thread_pool_destroy(thread_pool_t *pool) {
         pthread_join(pool->threads[i], NULL);
     }
 
+    thread_pool_stats_t *stats = &pool->stats;
+    if (stats->dropped_oldest || stats->dropped_class || stats->dropped_sampled ||
+        stats->dropped_spill) {
+        log_warn("Thread pool shed events: oldest=%llu class=%llu sampled=%llu spill=%llu",
+                 stats->dropped_oldest, stats->dropped_class,
+                 stats->dropped_sampled, stats->dropped_spill);
+    }
+
     work_queue_destroy(&pool->queue);
     free(pool->threads);
     free(pool);
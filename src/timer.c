@@ -0,0 +1,305 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "timer.h"
+#include "util.h"
+
+// Four levels of 64 slots. A timer lives at the lowest level whose slot
+// range still contains both "now" and its expiry, and is cascaded down a
+// level each time the wheel reaches the start of its slot.
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_NO_DEADLINE UINT64_MAX
+
+struct timer_wheel {
+    int fd;
+    uint64_t base_ns;
+    uint64_t now_tick;           // next tick to be processed
+    uint64_t programmed_tick;
+    int armed_count;
+    uint64_t occupied[WHEEL_LEVELS];
+    wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+uint64_t timer_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t wheel_ns_to_tick(timer_wheel_t *wheel, uint64_t ns) {
+    if (ns <= wheel->base_ns) return 0;
+    // Round up so a timer never fires before its deadline.
+    return (ns - wheel->base_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+}
+
+static void list_init(wheel_timer_t *head) {
+    head->next = head->prev = head;
+}
+
+static int list_empty(const wheel_timer_t *head) {
+    return head->next == head;
+}
+
+static void list_add_tail(wheel_timer_t *head, wheel_timer_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(wheel_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+static void wheel_enqueue(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    uint64_t expires = timer->expires < wheel->now_tick ? wheel->now_tick : timer->expires;
+    int level;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * (level + 1);
+        if ((expires >> shift) == (wheel->now_tick >> shift)) {
+            break;
+        }
+    }
+
+    int slot;
+    if (level < WHEEL_LEVELS) {
+        slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    } else {
+        // Beyond the wheel's horizon: park in the top level's last slot and
+        // re-evaluate when it cascades.
+        level = WHEEL_LEVELS - 1;
+        slot = ((wheel->now_tick >> (WHEEL_BITS * level)) - 1) & WHEEL_MASK;
+    }
+
+    timer->level = level;
+    timer->slot = slot;
+    list_add_tail(&wheel->slots[level][slot], timer);
+    wheel->occupied[level] |= 1ull << slot;
+}
+
+static void wheel_unlink(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    list_del(timer);
+    if (list_empty(&wheel->slots[timer->level][timer->slot])) {
+        wheel->occupied[timer->level] &= ~(1ull << timer->slot);
+    }
+}
+
+// Detaches a whole slot so callbacks can freely re-arm or cancel timers.
+static void wheel_take_slot(timer_wheel_t *wheel, int level, int slot, wheel_timer_t *out) {
+    wheel_timer_t *head = &wheel->slots[level][slot];
+
+    list_init(out);
+    if (list_empty(head)) return;
+
+    out->next = head->next;
+    out->prev = head->prev;
+    out->next->prev = out;
+    out->prev->next = out;
+    list_init(head);
+    wheel->occupied[level] &= ~(1ull << slot);
+}
+
+static void wheel_cascade(timer_wheel_t *wheel, int level) {
+    wheel_timer_t pending;
+    int slot = (wheel->now_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    wheel_take_slot(wheel, level, slot, &pending);
+    while (!list_empty(&pending)) {
+        wheel_timer_t *timer = pending.next;
+        list_del(timer);
+        wheel_enqueue(wheel, timer);
+    }
+}
+
+static int wheel_process_tick(timer_wheel_t *wheel) {
+    int fired = 0;
+
+    // Higher levels first: a level-2 cascade can refill the level-1 slot
+    // that is about to cascade in the same tick.
+    for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+        uint64_t span = 1ull << (WHEEL_BITS * level);
+        if ((wheel->now_tick & (span - 1)) == 0) {
+            wheel_cascade(wheel, level);
+        }
+    }
+
+    wheel_timer_t expired;
+    wheel_take_slot(wheel, 0, wheel->now_tick & WHEEL_MASK, &expired);
+    wheel->now_tick++;
+
+    while (!list_empty(&expired)) {
+        wheel_timer_t *timer = expired.next;
+        list_del(timer);
+        timer->armed = 0;
+        wheel->armed_count--;
+        timer->fn(timer, timer->arg);
+        fired++;
+    }
+
+    return fired;
+}
+
+static int wheel_lowest_occupied(timer_wheel_t *wheel) {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        if (wheel->occupied[level]) return level;
+    }
+    return -1;
+}
+
+static uint64_t wheel_next_tick(timer_wheel_t *wheel) {
+    int level = wheel_lowest_occupied(wheel);
+    if (level < 0) return WHEEL_NO_DEADLINE;
+
+    if (level == 0) {
+        int index = wheel->now_tick & WHEEL_MASK;
+        uint64_t bits = wheel->occupied[0];
+        uint64_t rotated = (bits >> index) | (index ? bits << (WHEEL_SLOTS - index) : 0);
+        return wheel->now_tick + __builtin_ctzll(rotated);
+    }
+
+    // Nothing can fire before the next cascade of the lowest busy level.
+    uint64_t span = 1ull << (WHEEL_BITS * level);
+    return (wheel->now_tick + span - 1) & ~(span - 1);
+}
+
+static void wheel_program(timer_wheel_t *wheel) {
+    uint64_t tick = wheel_next_tick(wheel);
+    if (tick == wheel->programmed_tick) return;
+
+    struct itimerspec spec = {0};
+    if (tick != WHEEL_NO_DEADLINE) {
+        uint64_t ns = wheel->base_ns + tick * TIMER_TICK_NS;
+        spec.it_value.tv_sec = ns / 1000000000ull;
+        spec.it_value.tv_nsec = ns % 1000000000ull;
+        // An all-zero it_value would disarm the timer instead of firing.
+        if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec) {
+            spec.it_value.tv_nsec = 1;
+        }
+    }
+
+    if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0) {
+        log_error("Failed to program timer wheel: %s", strerror(errno));
+        return;
+    }
+    wheel->programmed_tick = tick;
+}
+
+timer_wheel_t *timer_wheel_create(void) {
+    timer_wheel_t *wheel = calloc(1, sizeof(timer_wheel_t));
+    if (!wheel) return NULL;
+
+    wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (wheel->fd < 0) {
+        log_error("Failed to create timerfd: %s", strerror(errno));
+        free(wheel);
+        return NULL;
+    }
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+
+    wheel->base_ns = timer_now_ns();
+    wheel->now_tick = 0;
+    wheel->programmed_tick = WHEEL_NO_DEADLINE;
+    return wheel;
+}
+
+void timer_wheel_destroy(timer_wheel_t *wheel) {
+    if (!wheel) return;
+
+    if (wheel->armed_count) {
+        log_warn("Destroying timer wheel with %d armed timers", wheel->armed_count);
+    }
+    close(wheel->fd);
+    free(wheel);
+}
+
+int timer_wheel_fd(timer_wheel_t *wheel) {
+    return wheel ? wheel->fd : -1;
+}
+
+void timer_init(wheel_timer_t *timer, wheel_timer_fn_t fn, void *arg) {
+    memset(timer, 0, sizeof(*timer));
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+int timer_arm(timer_wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline_ns) {
+    if (!wheel || !timer || !timer->fn) return -1;
+
+    if (timer->armed) {
+        wheel_unlink(wheel, timer);
+    } else {
+        wheel->armed_count++;
+    }
+
+    timer->expires = wheel_ns_to_tick(wheel, deadline_ns);
+    timer->armed = 1;
+    wheel_enqueue(wheel, timer);
+
+    // Only touch the timerfd when this timer becomes the earliest deadline.
+    if (timer->expires < wheel->programmed_tick) {
+        wheel_program(wheel);
+    }
+    return 0;
+}
+
+void timer_cancel(timer_wheel_t *wheel, wheel_timer_t *timer) {
+    if (!wheel || !timer || !timer->armed) return;
+
+    wheel_unlink(wheel, timer);
+    timer->armed = 0;
+    wheel->armed_count--;
+}
+
+int timer_wheel_run(timer_wheel_t *wheel) {
+    if (!wheel) return -1;
+
+    uint64_t expirations;
+    if (read(wheel->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        log_warn("Failed to read timerfd: %s", strerror(errno));
+    }
+
+    uint64_t target = (timer_now_ns() - wheel->base_ns) / TIMER_TICK_NS;
+    int fired = 0;
+
+    while (wheel->now_tick <= target) {
+        int level = wheel_lowest_occupied(wheel);
+        if (level < 0) {
+            wheel->now_tick = target + 1;
+            break;
+        }
+
+        // Skip straight to the next tick that can do any work.
+        if (level > 0) {
+            uint64_t span = 1ull << (WHEEL_BITS * level);
+            uint64_t next = (wheel->now_tick + span - 1) & ~(span - 1);
+            if (next > target) {
+                wheel->now_tick = target + 1;
+                break;
+            }
+            wheel->now_tick = next;
+        }
+
+        fired += wheel_process_tick(wheel);
+    }
+
+    // Cancelled timers can leave the timerfd pointing at an empty slot;
+    // force a reprogram from the current state.
+    wheel->programmed_tick = 0;
+    wheel_program(wheel);
+    return fired;
+}
@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+#include "trace.h"
+#include "util.h"
+
+// On-disk layout: a trace_header_t followed by a stream of records. Each
+// record is a tag byte (trap type + 1) and three LEB128 varints: timestamp
+// delta in ns, zigzag-encoded address delta, and the raw data word. A zero
+// tag ends the stream; TRACE_TAG_SKIP pads out the rest of a mapped window.
+// Records go straight into the shared file mapping, so everything written
+// before a crash is on disk even though the header is never finalized.
+#define TRACE_TAG_END 0x00
+#define TRACE_TAG_MAX (TRAP_EXCEPTION + 1)
+#define TRACE_TAG_SKIP 0xff
+#define TRACE_MAX_RECORD_SIZE (1 + 3 * 10)
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t window_size;
+    uint64_t start_ns;
+    uint64_t data_size;
+} trace_header_t;
+
+struct trace_writer {
+    int fd;
+    uint8_t *window;
+    size_t window_size;
+    uint64_t window_offset;
+    size_t pos;
+    uint64_t last_ns;
+    uint64_t last_address;
+    _Atomic uint64_t events;
+    pthread_mutex_t lock;
+};
+
+struct trace_reader {
+    uint8_t *data;
+    size_t map_size;
+    size_t size;
+    size_t pos;
+    uint64_t window_size;
+    uint64_t last_ns;
+    uint64_t last_address;
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t varint_encode(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+static int varint_decode(const uint8_t *in, size_t avail, size_t *consumed, uint64_t *value) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < avail && i < 10; i++) {
+        result |= (uint64_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *consumed = i + 1;
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static int trace_map_window(trace_writer_t *writer, uint64_t offset) {
+    if (ftruncate(writer->fd, offset + writer->window_size) != 0) {
+        log_error("Failed to extend trace file: %s", strerror(errno));
+        return -1;
+    }
+
+    void *window = mmap(NULL, writer->window_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, writer->fd, offset);
+    if (window == MAP_FAILED) {
+        log_error("Failed to map trace window: %s", strerror(errno));
+        return -1;
+    }
+
+    writer->window = window;
+    writer->window_offset = offset;
+    writer->pos = 0;
+    return 0;
+}
+
+static int trace_advance_window(trace_writer_t *writer) {
+    if (writer->pos < writer->window_size) {
+        writer->window[writer->pos] = TRACE_TAG_SKIP;
+    }
+    munmap(writer->window, writer->window_size);
+    writer->window = NULL;
+    return trace_map_window(writer, writer->window_offset + writer->window_size);
+}
+
+trace_writer_t *trace_writer_open(const char *path, size_t window_size) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+
+    if (window_size == 0) {
+        window_size = TRACE_DEFAULT_WINDOW_SIZE;
+    }
+    window_size = (window_size + page_size - 1) & ~(page_size - 1);
+
+    trace_writer_t *writer = calloc(1, sizeof(trace_writer_t));
+    if (!writer) return NULL;
+
+    writer->window_size = window_size;
+    writer->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (writer->fd < 0) {
+        log_error("Failed to open trace file %s: %s", path, strerror(errno));
+        free(writer);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&writer->lock, NULL) != 0) {
+        close(writer->fd);
+        free(writer);
+        return NULL;
+    }
+
+    if (trace_map_window(writer, 0) != 0) {
+        pthread_mutex_destroy(&writer->lock);
+        close(writer->fd);
+        free(writer);
+        return NULL;
+    }
+
+    writer->last_ns = monotonic_ns();
+
+    trace_header_t header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .header_size = sizeof(trace_header_t),
+        .window_size = window_size,
+        .start_ns = writer->last_ns,
+        .data_size = 0
+    };
+    memcpy(writer->window, &header, sizeof(header));
+    writer->pos = sizeof(header);
+
+    log_info("Recording trap trace to %s", path);
+    return writer;
+}
+
+int trace_write_event(trace_writer_t *writer, const trap_event_t *event) {
+    if (!writer || !event) return -1;
+
+    uint64_t now = monotonic_ns();
+
+    pthread_mutex_lock(&writer->lock);
+
+    if (writer->window_size - writer->pos < TRACE_MAX_RECORD_SIZE) {
+        if (trace_advance_window(writer) != 0) {
+            pthread_mutex_unlock(&writer->lock);
+            return -1;
+        }
+    }
+
+    // Timestamps are taken before the lock, so a racing writer can land
+    // slightly out of order; clamp instead of encoding a negative delta.
+    uint64_t delta_ns = now > writer->last_ns ? now - writer->last_ns : 0;
+    int64_t delta_address = (int64_t)(event->address - writer->last_address);
+
+    uint8_t *out = writer->window + writer->pos;
+    size_t n = 0;
+    out[n++] = (uint8_t)(event->type + 1);
+    n += varint_encode(out + n, delta_ns);
+    n += varint_encode(out + n, zigzag_encode(delta_address));
+    n += varint_encode(out + n, event->data);
+
+    writer->pos += n;
+    writer->last_ns += delta_ns;
+    writer->last_address = event->address;
+
+    pthread_mutex_unlock(&writer->lock);
+
+    atomic_fetch_add_explicit(&writer->events, 1, memory_order_relaxed);
+    return 0;
+}
+
+uint64_t trace_writer_event_count(trace_writer_t *writer) {
+    if (!writer) return 0;
+    return atomic_load_explicit(&writer->events, memory_order_relaxed);
+}
+
+// Nothing may still be recording: detach the writer first with
+// trap_set_trace_writer(NULL) or trap_cleanup(), which wait out calls in flight.
+void trace_writer_close(trace_writer_t *writer) {
+    if (!writer) return;
+
+    uint64_t data_size = writer->window_offset + writer->pos;
+
+    if (writer->window) {
+        munmap(writer->window, writer->window_size);
+    }
+
+    if (ftruncate(writer->fd, data_size) != 0) {
+        log_warn("Failed to trim trace file: %s", strerror(errno));
+    }
+
+    if (pwrite(writer->fd, &data_size, sizeof(data_size),
+               offsetof(trace_header_t, data_size)) != sizeof(data_size)) {
+        log_warn("Failed to finalize trace header: %s", strerror(errno));
+    }
+
+    log_info("Trap trace closed: %llu events, %llu bytes",
+             (unsigned long long)atomic_load(&writer->events), data_size);
+
+    close(writer->fd);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer);
+}
+
+trace_reader_t *trace_reader_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_error("Failed to open trace file %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(trace_header_t)) {
+        log_error("Trace file %s is truncated", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_error("Failed to map trace file: %s", strerror(errno));
+        return NULL;
+    }
+
+    const trace_header_t *header = data;
+    if (header->magic != TRACE_MAGIC || header->version != TRACE_VERSION ||
+        header->window_size == 0 || header->header_size < sizeof(trace_header_t) ||
+        header->header_size > (size_t)st.st_size) {
+        log_error("Unsupported trace file format in %s", path);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    trace_reader_t *reader = calloc(1, sizeof(trace_reader_t));
+    if (!reader) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    reader->data = data;
+    reader->map_size = st.st_size;
+    reader->size = st.st_size;
+    // A writer that never closed leaves data_size at zero; fall back to the
+    // file length and rely on the zero end tag in the unused tail.
+    if (header->data_size && header->data_size <= reader->size) {
+        reader->size = header->data_size;
+    }
+    reader->pos = header->header_size;
+    reader->window_size = header->window_size;
+    reader->last_ns = header->start_ns;
+    return reader;
+}
+
+int trace_reader_next(trace_reader_t *reader, trap_event_t *event, uint64_t *timestamp_ns) {
+    if (!reader || !event) return -1;
+
+    while (reader->pos < reader->size) {
+        uint8_t tag = reader->data[reader->pos];
+
+        if (tag == TRACE_TAG_END) {
+            return 1;
+        }
+
+        if (tag == TRACE_TAG_SKIP) {
+            reader->pos = (reader->pos / reader->window_size + 1) * reader->window_size;
+            continue;
+        }
+
+        if (tag > TRACE_TAG_MAX) {
+            log_error("Corrupt trace record at offset %zu", reader->pos);
+            return -1;
+        }
+
+        size_t pos = reader->pos + 1;
+        uint64_t fields[3];
+        for (int i = 0; i < 3; i++) {
+            size_t consumed;
+            if (varint_decode(reader->data + pos, reader->size - pos, &consumed, &fields[i]) != 0) {
+                log_error("Corrupt trace record at offset %zu", reader->pos);
+                return -1;
+            }
+            pos += consumed;
+        }
+
+        reader->last_ns += fields[0];
+        reader->last_address += (uint64_t)zigzag_decode(fields[1]);
+        reader->pos = pos;
+
+        memset(event, 0, sizeof(*event));
+        event->type = (trap_type_t)(tag - 1);
+        event->address = reader->last_address;
+        event->data = fields[2];
+        if (timestamp_ns) {
+            *timestamp_ns = reader->last_ns;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+void trace_reader_close(trace_reader_t *reader) {
+    if (!reader) return;
+    munmap(reader->data, reader->map_size);
+    free(reader);
+}
+
+int trace_replay(const char *path, thread_pool_t *pool, trace_replay_mode_t mode,
+                 trace_replay_stats_t *stats) {
+    if (!pool) {
+        log_error("Trace replay requires a thread pool");
+        return -1;
+    }
+
+    trace_reader_t *reader = trace_reader_open(path);
+    if (!reader) return -1;
+
+    trace_replay_stats_t local = {0};
+    trap_event_t event;
+    uint64_t timestamp_ns;
+    uint64_t first_ns = 0;
+    uint64_t start_ns = monotonic_ns();
+    int result;
+
+    log_info("Replaying trap trace %s (%s)", path,
+             mode == TRACE_REPLAY_REALTIME ? "recorded speed" : "as fast as possible");
+
+    while ((result = trace_reader_next(reader, &event, &timestamp_ns)) == 0) {
+        if (local.events == 0) {
+            first_ns = timestamp_ns;
+        }
+        local.events++;
+
+        if (mode == TRACE_REPLAY_REALTIME) {
+            uint64_t target_ns = start_ns + (timestamp_ns - first_ns);
+            struct timespec deadline = {
+                .tv_sec = target_ns / 1000000000ull,
+                .tv_nsec = target_ns % 1000000000ull
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+            }
+        }
+
+        int submitted = thread_pool_submit(pool, &event);
+        if (submitted < 0) {
+            log_error("Thread pool rejected replayed event");
+            result = -1;
+            break;
+        }
+        if (submitted == 0) {
+            local.submitted++;
+        } else {
+            local.shed++;
+        }
+    }
+
+    local.elapsed_ns = monotonic_ns() - start_ns;
+    trace_reader_close(reader);
+
+    log_info("Replay finished: %llu events, %llu submitted, %llu shed in %llu ns",
+             local.events, local.submitted, local.shed, local.elapsed_ns);
+
+    if (stats) {
+        *stats = local;
+    }
+
+    return result < 0 ? -1 : 0;
+}
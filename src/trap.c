@@ -2,20 +2,521 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ucontext.h>
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include "trap.h"
+#include "trace.h"
+#include "metrics.h"
 #include "util.h"
 
+#define TRAP_WAIT_TIMEOUT_MS 100
+#define TRAP_RESOLVE_TIMEOUT_SEC 5
+
+// x86 page fault error code bit for a write access.
+#define TRAP_X86_PF_WRITE 0x2
+
+// Bounded MPSC ring (per-slot sequence numbers): any thread may post, only
+// the owning vCPU pops, and neither side takes a lock.
+typedef struct {
+    _Atomic uint64_t sequence;
+    trap_event_t event;
+} trap_vcpu_slot_t;
+
+typedef struct trap_vcpu_source {
+    trap_vcpu_slot_t slots[TRAP_VCPU_QUEUE_SIZE];
+    _Atomic uint64_t tail;
+    uint64_t head;
+    _Atomic uint64_t dropped;
+    int event_fd;
+    struct trap_vcpu_source *next_retired;
+} trap_vcpu_source_t;
+
+typedef enum {
+    TRAP_VERDICT_PENDING,
+    TRAP_VERDICT_RESOLVED,      // page fixed up: retry the access
+    TRAP_VERDICT_EMULATED,      // access done by the resolver: skip it
+    TRAP_VERDICT_FATAL
+} trap_verdict_t;
+
+// The faulting instruction as far as the handler could decode it. len is 0
+// when it couldn't, and such an access can't be emulated.
+typedef struct {
+    uint8_t len;
+    uint8_t size;
+    uint8_t dest_size;          // register width a load fills (MOVZX widens)
+    uint8_t shift;              // 8 for the legacy high-byte registers
+    uint8_t write;
+    int8_t reg;                 // source/destination register, -1 for an immediate
+} trap_access_t;
+
+typedef struct {
+    trap_event_t event;
+    _Atomic uint32_t verdict;   // futex word the faulting thread sleeps on
+    int wait;
+    trap_access_t access;
+} trap_signal_slot_t;
+
+// Wait-free SPSC ring written only by its owner thread, from the signal
+// handler, and drained only by the consumer thread. The handler blocks
+// SIGSEGV/SIGBUS/SIGILL while it runs, so a producer is never re-entered.
+typedef struct {
+    trap_signal_slot_t slots[TRAP_SIGNAL_RING_SIZE];
+    _Atomic uint64_t tail;
+    _Atomic uint64_t head;
+    _Atomic uint64_t dropped;
+    atomic_int owned;
+    int vcpu_id;                                // where unresolved faults go, -1 for none
+} trap_signal_ring_t;
+
 typedef struct {
     int initialized;
     void *trap_page;
     size_t trap_page_size;
-    trap_handler_t handler;
-    trap_event_queue_t *queue;
-    pthread_mutex_t lock;
+    int event_fd;                               // doorbell for the signal rings
+    trap_signal_ring_t rings[TRAP_MAX_SIGNAL_RINGS];
+    atomic_int ring_count;                      // high-water mark of claimed rings
+    pthread_t consumer;
+    atomic_int consumer_stop;
+    _Atomic(uint8_t *) guest_base;
+    _Atomic uint64_t guest_size;
+    _Atomic(trap_resolver_t) resolver;
+    atomic_int resolve_calls;                   // resolver calls in flight
+    // Read without locks by the consumer, pool workers (IRQ kicks) and the
+    // vCPUs. Unregistered sources are only retired; trap_cleanup() frees
+    // them once none of those threads is left.
+    _Atomic(trap_vcpu_source_t *) vcpu_sources[TRAP_MAX_VCPUS];
+    trap_vcpu_source_t *retired_sources;
+    pthread_mutex_t sources_lock;
+    _Atomic(trace_writer_t *) tracer;
+    atomic_int trace_calls;                     // trap_trace() calls in flight
 } trap_state_t;
 
-static trap_state_t trap_state = {0};
+static trap_state_t trap_state = {
+    .sources_lock = PTHREAD_MUTEX_INITIALIZER
+};
+static _Thread_local trap_signal_ring_t *trap_thread_ring;
+
+static trap_vcpu_source_t *trap_vcpu_source(int vcpu_id) {
+    if (vcpu_id < 0 || vcpu_id >= TRAP_MAX_VCPUS) {
+        return NULL;
+    }
+    return atomic_load_explicit(&trap_state.vcpu_sources[vcpu_id], memory_order_acquire);
+}
+
+// Async-signal-safe: a full counter (EAGAIN) already means "readable".
+static void trap_doorbell(int fd) {
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one));
+    (void)n;
+}
+
+static void trap_ring_doorbell(trap_vcpu_source_t *source) {
+    uint64_t one = 1;
+    if (write(source->event_fd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        log_warn("Failed to signal vCPU event source: %s", strerror(errno));
+    }
+}
+
+// Callers bump an in-flight counter before loading a pointer and drop it
+// when done (both seq_cst), so a setter that stores the new pointer and
+// then waits here knows nobody still uses the old one.
+static void trap_wait_idle(atomic_int *calls) {
+    while (atomic_load(calls) != 0) {
+        sched_yield();
+    }
+}
+
+static void trap_trace(const trap_event_t *event) {
+    atomic_fetch_add(&trap_state.trace_calls, 1);
+    trace_writer_t *tracer = atomic_load(&trap_state.tracer);
+    if (tracer) {
+        trace_write_event(tracer, event);
+    }
+    atomic_fetch_sub_explicit(&trap_state.trace_calls, 1, memory_order_release);
+    metrics_record_trap(event);
+}
+
+// Sleeps until the consumer has ruled on the fault and returns the
+// verdict; a timeout counts as fatal.
+static uint32_t trap_signal_wait(trap_signal_slot_t *slot) {
+    struct timespec timeout = { .tv_sec = TRAP_RESOLVE_TIMEOUT_SEC };
+    uint32_t verdict;
+
+    while ((verdict = atomic_load_explicit(&slot->verdict, memory_order_acquire)) ==
+           TRAP_VERDICT_PENDING) {
+        long r = syscall(SYS_futex, &slot->verdict, FUTEX_WAIT_PRIVATE, TRAP_VERDICT_PENDING,
+                         &timeout, NULL, 0);
+        if (r < 0 && errno == ETIMEDOUT) {
+            return TRAP_VERDICT_FATAL;
+        }
+    }
+    return verdict;
+}
+
+#if defined(__x86_64__)
+// gregs[] index of each register by its x86 encoding number.
+static const int trap_x86_gregs[16] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+};
+
+// Decodes the MOV forms used for device register access (88/89/8A/8B, C6/C7
+// with an immediate, and MOVZX 0F B6/B7 for narrow reads), which is all
+// MMIO emulation needs. Returns 0 and fills access (and imm for an
+// immediate store), -1 for anything else.
+static int trap_x86_decode(const uint8_t *ip, trap_access_t *access, uint64_t *imm) {
+    const uint8_t *p = ip;
+    int operand16 = 0;
+    uint8_t rex = 0;
+
+    for (int i = 0; i < 4; i++, p++) {
+        if (*p == 0x66) {
+            operand16 = 1;
+        } else if (*p != 0x67 && *p != 0x26 && *p != 0x2e && *p != 0x36 && *p != 0x3e &&
+                   *p != 0x64 && *p != 0x65) {
+            break;
+        }
+    }
+    if ((*p & 0xf0) == 0x40) {
+        rex = *p++;
+    }
+
+    uint8_t opcode = *p++;
+    unsigned size = (rex & 0x8) ? 8 : operand16 ? 2 : 4;
+    unsigned dest_size = 0;
+    unsigned imm_size = 0;
+    if (opcode == 0x0f) {
+        opcode = *p++;
+        if (opcode != 0xb6 && opcode != 0xb7) {
+            return -1;
+        }
+        dest_size = size;
+        size = opcode == 0xb6 ? 1 : 2;
+        opcode = 0x8b;
+    }
+    switch (opcode) {
+        case 0x88: size = 1; access->write = 1; break;
+        case 0x89: access->write = 1; break;
+        case 0x8a: size = 1; access->write = 0; break;
+        case 0x8b: access->write = 0; break;
+        case 0xc6: size = 1; imm_size = 1; access->write = 1; break;
+        case 0xc7: imm_size = size == 2 ? 2 : 4; access->write = 1; break;
+        default: return -1;
+    }
+
+    uint8_t modrm = *p++;
+    unsigned mod = modrm >> 6;
+    unsigned reg = (modrm >> 3) & 7;
+    unsigned rm = modrm & 7;
+    if (mod == 3 || (imm_size && reg != 0)) {
+        return -1;
+    }
+    if (rm == 4) {
+        uint8_t sib = *p++;
+        if (mod == 0 && (sib & 7) == 5) p += 4;
+    } else if (mod == 0 && rm == 5) {
+        p += 4;                                 // RIP-relative
+    }
+    if (mod == 1) p += 1;
+    else if (mod == 2) p += 4;
+
+    access->size = size;
+    access->dest_size = dest_size ? dest_size : size;
+    access->shift = 0;
+    if (imm_size) {
+        int64_t value = imm_size == 1 ? (int8_t)p[0]
+                      : imm_size == 2 ? (int16_t)(p[0] | p[1] << 8)
+                      : (int32_t)((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                                  (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        *imm = (uint64_t)value;
+        access->reg = -1;
+        p += imm_size;
+    } else {
+        reg |= (rex & 0x4) ? 8 : 0;
+        if (access->dest_size == 1 && !rex && reg >= 4) {
+            reg -= 4;                           // AH, CH, DH, BH
+            access->shift = 8;
+        }
+        access->reg = (int8_t)reg;
+    }
+    access->len = (uint8_t)(p - ip);
+    return 0;
+}
+#endif
+
+// Fills in the event's syndrome and, for a decoded store, the value being
+// written.
+static void trap_signal_describe(int sig, const siginfo_t *info, void *context, int guest,
+                                 trap_signal_slot_t *slot) {
+    slot->event.data = 0;
+    slot->event.value = 0;
+    memset(&slot->access, 0, sizeof(slot->access));
+
+    if (sig == SIGILL) {
+        slot->event.data = (uint64_t)info->si_code;
+        return;
+    }
+
+#if defined(__x86_64__)
+    ucontext_t *uc = context;
+    if (uc->uc_mcontext.gregs[REG_ERR] & TRAP_X86_PF_WRITE) {
+        slot->event.data |= TRAP_MEM_WNR;
+    }
+
+    trap_access_t *access = &slot->access;
+    uint64_t imm = 0;
+    if (!guest || trap_x86_decode((const uint8_t *)uc->uc_mcontext.gregs[REG_RIP], access, &imm) != 0) {
+        memset(access, 0, sizeof(*access));
+        return;
+    }
+
+    slot->event.data = TRAP_MEM_ISV |
+                       ((uint64_t)__builtin_ctz(access->size) << TRAP_MEM_SAS_SHIFT) |
+                       ((uint64_t)(access->reg < 0 ? 0 : access->reg) << TRAP_MEM_SRT_SHIFT) |
+                       (access->write ? TRAP_MEM_WNR : 0);
+    if (access->write) {
+        uint64_t value = access->reg < 0 ? imm
+                       : (uint64_t)uc->uc_mcontext.gregs[trap_x86_gregs[access->reg]] >> access->shift;
+        slot->event.value = access->size == 8 ? value : value & ((1ull << (access->size * 8)) - 1);
+    }
+#else
+    (void)context;
+    (void)guest;
+#endif
+}
+
+// The resolver emulated the access: load a read result into the
+// destination register and step over the instruction.
+static void trap_signal_complete(void *context, const trap_signal_slot_t *slot) {
+#if defined(__x86_64__)
+    ucontext_t *uc = context;
+    const trap_access_t *access = &slot->access;
+
+    if (!access->write && access->reg >= 0) {
+        greg_t *reg = &uc->uc_mcontext.gregs[trap_x86_gregs[access->reg]];
+        uint64_t value = access->size == 8 ? slot->event.value
+                       : slot->event.value & ((1ull << (access->size * 8)) - 1);
+        if (access->dest_size == 8) {
+            *reg = (greg_t)value;
+        } else if (access->dest_size == 4) {
+            *reg = (greg_t)(uint32_t)value;     // 32-bit loads zero-extend
+        } else {
+            uint64_t mask = ((1ull << (access->dest_size * 8)) - 1) << access->shift;
+            *reg = (greg_t)(((uint64_t)*reg & ~mask) | ((value << access->shift) & mask));
+        }
+    }
+    uc->uc_mcontext.gregs[REG_RIP] += access->len;
+#else
+    (void)context;
+    (void)slot;
+#endif
+}
+
+// Runs on the faulting thread with only atomics, write(2) and futex(2).
+// Guest memory faults are queued and the thread waits for the consumer
+// to fix the page up; anything else (or a fault nobody can fix) is still
+// recorded, then re-raised with the default action.
+static void trap_signal_handler(int sig, siginfo_t *info, void *context) {
+    int saved_errno = errno;
+    trap_signal_ring_t *ring = trap_thread_ring;
+
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    uintptr_t base = (uintptr_t)atomic_load_explicit(&trap_state.guest_base, memory_order_acquire);
+    uint64_t size = atomic_load_explicit(&trap_state.guest_size, memory_order_acquire);
+    int guest = sig != SIGILL && base && addr - base < size;
+
+    if (ring) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        if (tail - head < TRAP_SIGNAL_RING_SIZE) {
+            trap_signal_slot_t *slot = &ring->slots[tail % TRAP_SIGNAL_RING_SIZE];
+            slot->event.type = sig == SIGILL ? TRAP_EXCEPTION : TRAP_MEMORY;
+            slot->event.address = guest ? addr - base : addr;
+            slot->event.scratch = NULL;
+            trap_signal_describe(sig, info, context, guest, slot);
+            slot->wait = guest;
+            atomic_store_explicit(&slot->verdict, TRAP_VERDICT_PENDING, memory_order_relaxed);
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+            trap_doorbell(trap_state.event_fd);
+
+            if (guest) {
+                uint32_t verdict = trap_signal_wait(slot);
+                if (verdict == TRAP_VERDICT_EMULATED) {
+                    trap_signal_complete(context, slot);
+                }
+                if (verdict != TRAP_VERDICT_FATAL) {
+                    errno = saved_errno;
+                    return;
+                }
+            }
+        } else {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        }
+    }
+
+    // The signal stays blocked until we return, so the retried access
+    // faults again with the default action and takes the process down.
+    struct sigaction dfl;
+    memset(&dfl, 0, sizeof(dfl));
+    dfl.sa_handler = SIG_DFL;
+    sigaction(sig, &dfl, NULL);
+    errno = saved_errno;
+}
+
+int trap_register_thread(int vcpu_id) {
+    if (!trap_state.initialized) {
+        log_error("Trap subsystem not initialized.");
+        return -1;
+    }
+    if (trap_thread_ring) {
+        return 0;
+    }
+
+    for (int i = 0; i < TRAP_MAX_SIGNAL_RINGS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&trap_state.rings[i].owned, &expected, 1)) {
+            int count = atomic_load(&trap_state.ring_count);
+            while (count <= i && !atomic_compare_exchange_weak(&trap_state.ring_count, &count, i + 1)) {
+            }
+            trap_state.rings[i].vcpu_id = vcpu_id;
+            trap_thread_ring = &trap_state.rings[i];
+            return 0;
+        }
+    }
+
+    log_error("No free trap signal rings");
+    return -1;
+}
+
+// A thread only unregisters itself, so its ring is empty: every fault it
+// queued has been ruled on before the handler returned.
+void trap_unregister_thread(void) {
+    trap_signal_ring_t *ring = trap_thread_ring;
+    if (!ring) return;
+
+    uint64_t dropped = atomic_exchange(&ring->dropped, 0);
+    if (dropped) {
+        log_warn("Thread dropped %llu faults on a full trap ring.", dropped);
+    }
+
+    trap_thread_ring = NULL;
+    atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+void trap_set_guest_region(void *base, uint64_t size) {
+    // Size first on the way down, base first on the way up, so the handler
+    // never pairs a base with the wrong size.
+    if (base) {
+        atomic_store_explicit(&trap_state.guest_size, size, memory_order_release);
+        atomic_store_explicit(&trap_state.guest_base, base, memory_order_release);
+    } else {
+        atomic_store_explicit(&trap_state.guest_base, NULL, memory_order_release);
+        atomic_store_explicit(&trap_state.guest_size, 0, memory_order_release);
+        trap_wait_idle(&trap_state.resolve_calls);
+    }
+}
+
+void trap_set_fault_resolver(trap_resolver_t resolver) {
+    atomic_store(&trap_state.resolver, resolver);
+    if (!resolver) {
+        trap_wait_idle(&trap_state.resolve_calls);
+    }
+}
+
+// Traps nobody waits on (faults outside guest memory, SIGILL) go to the
+// faulting thread's vCPU, which dispatches them like any other trap.
+static void trap_route(const trap_signal_ring_t *ring, const trap_event_t *event) {
+    if (ring->vcpu_id >= 0 && trap_post_event(ring->vcpu_id, event) == 0) {
+        return;
+    }
+    trap_trace(event);
+    log_warn("Dropped unresolved fault at 0x%llx: no vCPU event source.", event->address);
+}
+
+// Drains every thread's signal ring. Guest memory faults are offered to
+// the resolver and their thread released before anything else happens,
+// since that thread is asleep in the handler until then. One the resolver
+// can't fix is fatal, so it is only recorded: there is no vCPU left to
+// dispatch it, and the resolver has already run the memory hooks.
+static void trap_consume_signal_rings(void) {
+    int count = atomic_load_explicit(&trap_state.ring_count, memory_order_acquire);
+
+    for (int index = 0; index < count; index++) {
+        trap_signal_ring_t *ring = &trap_state.rings[index];
+
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        while (head != atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+            trap_signal_slot_t *slot = &ring->slots[head % TRAP_SIGNAL_RING_SIZE];
+            trap_event_t event = slot->event;
+
+            if (slot->wait) {
+                atomic_fetch_add(&trap_state.resolve_calls, 1);
+                trap_resolver_t resolver = atomic_load(&trap_state.resolver);
+                int result = resolver ? resolver(&event) : TRAP_RESOLVE_NONE;
+                atomic_fetch_sub_explicit(&trap_state.resolve_calls, 1, memory_order_release);
+                uint32_t verdict = TRAP_VERDICT_FATAL;
+                if (result == TRAP_RESOLVE_RETRY) {
+                    verdict = TRAP_VERDICT_RESOLVED;
+                } else if (result == TRAP_RESOLVE_EMULATED && slot->access.len) {
+                    slot->event.value = event.value;
+                    verdict = TRAP_VERDICT_EMULATED;
+                }
+                // The thread dies once released, so get the fault on record
+                // first.
+                if (verdict == TRAP_VERDICT_FATAL) {
+                    trap_trace(&event);
+                }
+                atomic_store_explicit(&slot->verdict, verdict, memory_order_release);
+                syscall(SYS_futex, &slot->verdict, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+                atomic_store_explicit(&ring->head, ++head, memory_order_release);
+                if (verdict != TRAP_VERDICT_FATAL) {
+                    trap_trace(&event);
+                }
+                continue;
+            }
+
+            atomic_store_explicit(&ring->head, ++head, memory_order_release);
+            trap_route(ring, &event);
+        }
+    }
+}
+
+// The only consumer of the signal rings. It runs on its own thread so no
+// caller (vm_pause() waiting for vCPUs to park, a snapshot) can stall the
+// threads sleeping on a fault.
+static void *trap_consumer_loop(void *arg) {
+    (void)arg;
+    struct pollfd pfd = { .fd = trap_state.event_fd, .events = POLLIN };
+
+    while (!atomic_load_explicit(&trap_state.consumer_stop, memory_order_acquire)) {
+        trap_consume_signal_rings();
+
+        if (poll(&pfd, 1, TRAP_WAIT_TIMEOUT_MS) < 0 && errno != EINTR) {
+            log_error("Error waiting for trap event: %s", strerror(errno));
+        }
+
+        // Clear the doorbell before rescanning so a fault posted in between
+        // rings it again instead of being missed.
+        uint64_t value;
+        if (read(trap_state.event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            log_warn("Failed to drain trap doorbell: %s", strerror(errno));
+        }
+    }
+
+    trap_consume_signal_rings();
+    return NULL;
+}
 
 int trap_init(void) {
     if (trap_state.initialized) {
@@ -24,9 +525,10 @@ int trap_init(void) {
     }
 
     log_info("Initializing trapping subsystem...");
-    
-    if (pthread_mutex_init(&trap_state.lock, NULL) != 0) {
-        log_error("Failed to initialize trap mutex: %s", strerror(errno));
+
+    trap_state.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (trap_state.event_fd < 0) {
+        log_error("Failed to create trap doorbell: %s", strerror(errno));
         return -1;
     }
 
@@ -34,33 +536,45 @@ int trap_init(void) {
     trap_state.trap_page = mmap(NULL, trap_state.trap_page_size,
                                PROT_READ | PROT_WRITE,
                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    
+
     if (trap_state.trap_page == MAP_FAILED) {
         log_error("Failed to allocate trap page: %s", strerror(errno));
-        pthread_mutex_destroy(&trap_state.lock);
-        return -1;
-    }
-
-    trap_state.queue = trap_queue_create(MAX_TRAP_EVENTS);
-    if (!trap_state.queue) {
-        log_error("Failed to create trap event queue");
-        munmap(trap_state.trap_page, trap_state.trap_page_size);
-        pthread_mutex_destroy(&trap_state.lock);
+        trap_state.trap_page = NULL;
+        close(trap_state.event_fd);
         return -1;
     }
 
     struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
     sa.sa_flags = SA_SIGINFO;
     sigemptyset(&sa.sa_mask);
+    sigaddset(&sa.sa_mask, SIGSEGV);
+    sigaddset(&sa.sa_mask, SIGBUS);
+    sigaddset(&sa.sa_mask, SIGILL);
     sa.sa_sigaction = trap_signal_handler;
 
     if (sigaction(SIGSEGV, &sa, NULL) == -1 ||
         sigaction(SIGBUS, &sa, NULL) == -1 ||
         sigaction(SIGILL, &sa, NULL) == -1) {
         log_error("Failed to register signal handlers: %s", strerror(errno));
-        trap_queue_destroy(trap_state.queue);
+        signal(SIGSEGV, SIG_DFL);
+        signal(SIGBUS, SIG_DFL);
+        signal(SIGILL, SIG_DFL);
         munmap(trap_state.trap_page, trap_state.trap_page_size);
-        pthread_mutex_destroy(&trap_state.lock);
+        trap_state.trap_page = NULL;
+        close(trap_state.event_fd);
+        return -1;
+    }
+
+    atomic_store(&trap_state.consumer_stop, 0);
+    if (pthread_create(&trap_state.consumer, NULL, trap_consumer_loop, NULL) != 0) {
+        log_error("Failed to start trap consumer thread.");
+        signal(SIGSEGV, SIG_DFL);
+        signal(SIGBUS, SIG_DFL);
+        signal(SIGILL, SIG_DFL);
+        munmap(trap_state.trap_page, trap_state.trap_page_size);
+        trap_state.trap_page = NULL;
+        close(trap_state.event_fd);
         return -1;
     }
 
@@ -68,56 +582,147 @@ int trap_init(void) {
     return 0;
 }
 
-int trap_wait_for_event(trap_event_t *event) {
+int trap_register_vcpu(int vcpu_id) {
     if (!trap_state.initialized) {
         log_error("Trap subsystem not initialized.");
         return -1;
     }
 
-    if (!event) {
-        log_error("Invalid event pointer provided.");
+    if (vcpu_id < 0 || vcpu_id >= TRAP_MAX_VCPUS) {
+        log_error("Invalid vCPU id: %d", vcpu_id);
         return -1;
     }
 
-    pthread_mutex_lock(&trap_state.lock);
+    if (trap_vcpu_source(vcpu_id)) {
+        log_warn("vCPU %d already has an event source.", vcpu_id);
+        return 0;
+    }
 
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += TRAP_WAIT_TIMEOUT_SEC;
+    trap_vcpu_source_t *source = calloc(1, sizeof(trap_vcpu_source_t));
+    if (!source) {
+        log_error("Failed to allocate event source for vCPU %d", vcpu_id);
+        return -1;
+    }
 
-    int result = trap_queue_wait_and_pop(trap_state.queue, event, &timeout);
-    
-    if (result == 0) {
-        switch (event->type) {
-            case TRAP_TYPE_PAGE_FAULT:
-                handle_page_fault(event);
-                break;
-            case TRAP_TYPE_INVALID_INSTRUCTION:
-                handle_invalid_instruction(event);
-                break;
-            case TRAP_TYPE_DIVISION_ERROR:
-                handle_division_error(event);
+    source->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (source->event_fd < 0) {
+        log_error("Failed to create eventfd for vCPU %d: %s", vcpu_id, strerror(errno));
+        free(source);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < TRAP_VCPU_QUEUE_SIZE; i++) {
+        atomic_init(&source->slots[i].sequence, i);
+    }
+
+    trap_vcpu_source_t *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&trap_state.vcpu_sources[vcpu_id], &expected,
+                                                 source, memory_order_acq_rel,
+                                                 memory_order_acquire)) {
+        log_warn("vCPU %d already has an event source.", vcpu_id);
+        close(source->event_fd);
+        free(source);
+    }
+    return 0;
+}
+
+// Detaches the source so no new lookup finds it. A thread that loaded the
+// pointer just before may still post to or kick it, so the memory and the
+// eventfd stay around until trap_cleanup().
+void trap_unregister_vcpu(int vcpu_id) {
+    if (vcpu_id < 0 || vcpu_id >= TRAP_MAX_VCPUS) return;
+
+    trap_vcpu_source_t *source = atomic_exchange_explicit(&trap_state.vcpu_sources[vcpu_id], NULL,
+                                                          memory_order_acq_rel);
+    if (!source) return;
+
+    uint64_t dropped = atomic_load(&source->dropped);
+    if (dropped) {
+        log_warn("vCPU %d dropped %llu trap events on a full queue.", vcpu_id, dropped);
+    }
+
+    pthread_mutex_lock(&trap_state.sources_lock);
+    source->next_retired = trap_state.retired_sources;
+    trap_state.retired_sources = source;
+    pthread_mutex_unlock(&trap_state.sources_lock);
+}
+
+int trap_vcpu_event_fd(int vcpu_id) {
+    trap_vcpu_source_t *source = trap_vcpu_source(vcpu_id);
+    return source ? source->event_fd : -1;
+}
+
+int trap_post_event(int vcpu_id, const trap_event_t *event) {
+    trap_vcpu_source_t *source = trap_vcpu_source(vcpu_id);
+    if (!source || !event) return -1;
+
+    uint64_t pos = atomic_load_explicit(&source->tail, memory_order_relaxed);
+    trap_vcpu_slot_t *slot;
+    while (1) {
+        slot = &source->slots[pos % TRAP_VCPU_QUEUE_SIZE];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t)(sequence - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&source->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
                 break;
-            default:
-                log_warn("Unknown trap type: %d", event->type);
-                result = -1;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&source->dropped, 1, memory_order_relaxed);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&source->tail, memory_order_relaxed);
         }
-    } else if (result == ETIMEDOUT) {
-        log_debug("Trap wait timeout reached");
-        result = 1;
-    } else {
-        log_error("Error waiting for trap event: %s", strerror(errno));
-        result = -1;
     }
 
-    pthread_mutex_unlock(&trap_state.lock);
+    slot->event = *event;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+    trap_trace(event);
+    trap_ring_doorbell(source);
+    return 0;
+}
+
+int trap_pop_vcpu_event(int vcpu_id, trap_event_t *event) {
+    trap_vcpu_source_t *source = trap_vcpu_source(vcpu_id);
+    if (!source || !event) return -1;
+
+    trap_vcpu_slot_t *slot = &source->slots[source->head % TRAP_VCPU_QUEUE_SIZE];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != source->head + 1) {
+        return 1;
+    }
+
+    *event = slot->event;
+    atomic_store_explicit(&slot->sequence, source->head + TRAP_VCPU_QUEUE_SIZE,
+                          memory_order_release);
+    source->head++;
+    return 0;
+}
+
+void trap_ack_vcpu(int vcpu_id) {
+    trap_vcpu_source_t *source = trap_vcpu_source(vcpu_id);
+    if (!source) return;
 
-    if (result == 0) {
-        log_debug("Trap event received: type=%d, address=0x%llx, data=0x%llx",
-                  event->type, event->address, event->data);
+    uint64_t value;
+    if (read(source->event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        log_warn("Failed to drain vCPU %d event source: %s", vcpu_id, strerror(errno));
     }
+}
+
+void trap_kick_vcpu(int vcpu_id) {
+    trap_vcpu_source_t *source = trap_vcpu_source(vcpu_id);
+    if (source) {
+        trap_ring_doorbell(source);
+    }
+}
 
-    return result;
+// Returns once no thread is still recording to the previous writer, so it
+// can be closed right after detaching it.
+void trap_set_trace_writer(trace_writer_t *writer) {
+    atomic_store(&trap_state.tracer, writer);
+    trap_wait_idle(&trap_state.trace_calls);
 }
 
 void trap_cleanup(void) {
@@ -132,14 +737,41 @@ void trap_cleanup(void) {
     signal(SIGBUS, SIG_DFL);
     signal(SIGILL, SIG_DFL);
 
-    if (trap_state.queue) {
-        trap_queue_destroy(trap_state.queue);
+    atomic_store_explicit(&trap_state.consumer_stop, 1, memory_order_release);
+    trap_doorbell(trap_state.event_fd);
+    pthread_join(trap_state.consumer, NULL);
+
+    atomic_store(&trap_state.tracer, NULL);
+    atomic_store(&trap_state.resolver, NULL);
+
+    for (int i = 0; i < TRAP_MAX_VCPUS; i++) {
+        trap_unregister_vcpu(i);
+    }
+
+    // The consumer is joined and the VM (with its pool) stopped, so nothing
+    // can still hold a retired source.
+    pthread_mutex_lock(&trap_state.sources_lock);
+    while (trap_state.retired_sources) {
+        trap_vcpu_source_t *source = trap_state.retired_sources;
+        trap_state.retired_sources = source->next_retired;
+        close(source->event_fd);
+        free(source);
+    }
+    pthread_mutex_unlock(&trap_state.sources_lock);
+
+    int count = atomic_load(&trap_state.ring_count);
+    for (int i = 0; i < count; i++) {
+        uint64_t dropped = atomic_exchange(&trap_state.rings[i].dropped, 0);
+        if (dropped) {
+            log_warn("Trap ring %d dropped %llu faults.", i, dropped);
+        }
     }
 
     if (trap_state.trap_page) {
         munmap(trap_state.trap_page, trap_state.trap_page_size);
+        trap_state.trap_page = NULL;
     }
 
-    pthread_mutex_destroy(&trap_state.lock);
+    close(trap_state.event_fd);
     trap_state.initialized = 0;
 }
@@ -1,38 +1,504 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
 #include "vm.h"
 #include "trap.h"
+#include "irq.h"
+#include "timer.h"
+#include "arena.h"
+#include "scan.h"
+#include "dedup.h"
+#include "snapshot.h"
+#include "mmio.h"
+#include "memmap.h"
+#include "metrics.h"
 #include "hook.h"
+#include "thread_pool.h"
 #include "util.h"
 
+#define VCPU_POLL_TIMEOUT_MS 100
+#define VM_SUPERVISE_TIMEOUT_SEC 1
+#define VM_METRICS_POLL_MS 100
+#define VM_TRAP_SAMPLE_RATE 16
+#define VM_TRAP_SPILL_SIZE 4096
+#define VM_GUEST_TIMERS 1024
+#define VM_TIMER_REQUESTS 64
+#define VM_DEDUP_DEFAULT_INTERVAL_MS 100
+
+typedef enum {
+    VM_RUN_STARTING,
+    VM_RUN_RUNNING,
+    VM_RUN_PAUSED,
+    VM_RUN_STOPPING
+} vm_run_state_t;
+
+typedef struct {
+    wheel_timer_t timer;
+    int vcpu_id;
+    uint32_t irq;
+    uint64_t deadline_ns;
+    uint64_t period_ns;
+} guest_timer_t;
+
+typedef enum {
+    VM_TIMER_ARM_GUEST,
+    VM_TIMER_CANCEL_GUEST,
+    VM_TIMER_ARM_CALLBACK,
+    VM_TIMER_CANCEL_CALLBACK
+} vm_timer_op_t;
+
+// A change to a vCPU's timer wheel. Deadlines are absolute, so a request
+// queued from another thread doesn't drift while it waits.
+typedef struct {
+    vm_timer_op_t op;
+    uint32_t timer_id;
+    uint32_t irq;
+    wheel_timer_t *timer;
+    uint64_t deadline_ns;
+    uint64_t period_ns;
+} vm_timer_request_t;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int started;
+    uint64_t traps_handled;
+    timer_wheel_t *timers;
+    guest_timer_t guest_timers[VM_GUEST_TIMERS];
+    // Requests from other threads, under vm.lock; the count is also read
+    // without it so an idle loop doesn't take the lock.
+    vm_timer_request_t timer_requests[VM_TIMER_REQUESTS];
+    atomic_int timer_request_count;
+} vcpu_t;
+
 typedef struct {
     uint64_t *memory;
-    int running;
+    uint64_t memory_size;
+    atomic_int running;     // also read by vCPU and pool threads
     int vcpu_count;
+    vcpu_t *vcpus;
+    thread_pool_t *pool;
+    vm_run_state_t run_state;
+    int parked;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t state_changed;
+    vm_config_t config;
+    snapshot_t *restore;    // backs guest memory after vm_restore()
 } vm_state_t;
 
 static vm_state_t vm = {0};
+static _Thread_local int current_vcpu = -1;
 
 int vm_init(void) {
     log_info("Initializing VM subsystem...");
     memset(&vm, 0, sizeof(vm_state_t));
+
+    if (pthread_mutex_init(&vm.lock, NULL) != 0 ||
+        pthread_cond_init(&vm.state_changed, NULL) != 0) {
+        log_error("Failed to initialize VM synchronization: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int vm_current_vcpu(void) {
+    return current_vcpu;
+}
+
+static void vm_set_run_state(vm_run_state_t state) {
+    pthread_mutex_lock(&vm.lock);
+    vm.run_state = state;
+    pthread_cond_broadcast(&vm.state_changed);
+    pthread_mutex_unlock(&vm.lock);
+
+    for (int i = 0; i < vm.vcpu_count; i++) {
+        trap_kick_vcpu(i);
+    }
+}
+
+// Blocks while the VM is starting or paused. Returns 0 to keep running and
+// -1 once the VM is stopping.
+static int vcpu_wait_runnable(vcpu_t *vcpu) {
+    pthread_mutex_lock(&vm.lock);
+    if (vm.run_state == VM_RUN_PAUSED) {
+        vm.parked++;
+        pthread_cond_broadcast(&vm.state_changed);
+        while (vm.run_state == VM_RUN_PAUSED) {
+            pthread_cond_wait(&vm.state_changed, &vm.lock);
+        }
+        vm.parked--;
+    }
+    while (vm.run_state == VM_RUN_STARTING) {
+        pthread_cond_wait(&vm.state_changed, &vm.lock);
+    }
+    int stopping = vm.run_state == VM_RUN_STOPPING;
+    pthread_mutex_unlock(&vm.lock);
+
+    if (stopping) {
+        log_debug("vCPU %d leaving execution loop.", vcpu->id);
+    }
+    return stopping ? -1 : 0;
+}
+
+static uint8_t *vm_guest_ptr(uint64_t guest_addr) {
+    if (!vm.memory || guest_addr >= vm.memory_size) {
+        return NULL;
+    }
+    return (uint8_t *)vm.memory + guest_addr;
+}
+
+static int vm_access_allowed(const trap_event_t *event) {
+    memmap_range_t range;
+    uint32_t needed = (event->data & TRAP_MEM_WNR) ? MEMMAP_WRITE : MEMMAP_READ;
+    return memmap_lookup(event->address, &range) == 0 && (range.flags & needed) == needed;
+}
+
+// Faults the hypervisor fixes up itself, run by the trap consumer while
+// the faulting vCPU waits: writes to deduplicated pages and touches of
+// not-yet-restored snapshot chunks are retried, and MMIO accesses are
+// emulated on the spot. Anything else is fatal, so memory hooks get their
+// only look at it here; one that maps the page (demand paging) has the
+// access retried.
+static int vm_resolve_fault(trap_event_t *event) {
+    uint8_t *host = vm_guest_ptr(event->address);
+    if (!host) {
+        return TRAP_RESOLVE_NONE;
+    }
+    if (dedup_handle_write_fault(host) == 1 ||
+        (vm.restore && snapshot_fault_in(vm.restore, host) == 1)) {
+        return TRAP_RESOLVE_RETRY;
+    }
+    if (mmio_handle_access(event) == 1) {
+        return TRAP_RESOLVE_EMULATED;
+    }
+    if (!hook_lookup(HOOK_TYPE_MEMORY, event->address)) {
+        return TRAP_RESOLVE_NONE;
+    }
+
+    int blocked = !vm_access_allowed(event);
+    event->scratch = arena_thread_scratch();
+    int result = handle_memory_access(event);
+    arena_reset(event->scratch);
+    event->scratch = NULL;
+    return result == 0 && blocked && vm_access_allowed(event) ? TRAP_RESOLVE_RETRY
+                                                              : TRAP_RESOLVE_NONE;
+}
+
+// Exceptions are resolved on the vCPU that raised them; syscall and memory
+// hooks don't gate the vCPU, so they are handed to the async pool. Faults
+// the vCPU can't make progress without (dedup writes, lazy restore) never
+// get here: the trap consumer resolves them before releasing the vCPU.
+static int vcpu_handle_trap(vcpu_t *vcpu, trap_event_t *event) {
+    vcpu->traps_handled++;
+
+    switch (event->type) {
+        case TRAP_MEMORY:
+        case TRAP_SYSCALL:
+            if (thread_pool_submit(vm.pool, event) < 0) {
+                log_error("vCPU %d failed to queue trap event.", vcpu->id);
+                return -1;
+            }
+            return 0;
+        case TRAP_EXCEPTION: {
+            log_info("Intercepted exception from guest on vCPU %d.", vcpu->id);
+            event->scratch = arena_thread_scratch();
+            int result = handle_exception(event);
+            arena_reset(event->scratch);
+            if (result != 0) {
+                log_error("Failed to handle exception.");
+                return -1;
+            }
+            return 0;
+        }
+        default:
+            log_warn("Unknown trap type encountered: %d", event->type);
+            return 0;
+    }
+}
+
+static void vcpu_mark_failed(void) {
+    pthread_mutex_lock(&vm.lock);
+    vm.failed = 1;
+    pthread_cond_broadcast(&vm.state_changed);
+    pthread_mutex_unlock(&vm.lock);
+}
+
+static void vcpu_apply_timer_request(vcpu_t *vcpu, const vm_timer_request_t *request);
+
+static void vcpu_run_timer_requests(vcpu_t *vcpu) {
+    if (!atomic_load_explicit(&vcpu->timer_request_count, memory_order_acquire)) {
+        return;
+    }
+
+    vm_timer_request_t requests[VM_TIMER_REQUESTS];
+    pthread_mutex_lock(&vm.lock);
+    int count = atomic_load_explicit(&vcpu->timer_request_count, memory_order_relaxed);
+    memcpy(requests, vcpu->timer_requests, count * sizeof(vm_timer_request_t));
+    atomic_store_explicit(&vcpu->timer_request_count, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&vm.lock);
+
+    for (int i = 0; i < count; i++) {
+        vcpu_apply_timer_request(vcpu, &requests[i]);
+    }
+}
+
+static void *vcpu_loop(void *arg) {
+    vcpu_t *vcpu = (vcpu_t *)arg;
+    current_vcpu = vcpu->id;
+
+    // The wheel belongs to this thread: one timerfd serves every guest
+    // timer and hook callback scheduled on the vCPU.
+    vcpu->timers = timer_wheel_create();
+    if (!vcpu->timers) {
+        log_error("vCPU %d failed to create its timer wheel.", vcpu->id);
+        vcpu_mark_failed();
+        current_vcpu = -1;
+        return NULL;
+    }
+
+    // Without a ring, a fault on guest memory here can't be fixed up.
+    if (trap_register_thread(vcpu->id) != 0) {
+        log_warn("vCPU %d runs without fault capture.", vcpu->id);
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = trap_vcpu_event_fd(vcpu->id);
+    fds[0].events = POLLIN;
+    fds[1].fd = timer_wheel_fd(vcpu->timers);
+    fds[1].events = POLLIN;
+
+    while (vcpu_wait_runnable(vcpu) == 0) {
+        trap_event_t event;
+        int result;
+
+        irq_deliver_pending(vcpu->id);
+        vcpu_run_timer_requests(vcpu);
+
+        while ((result = trap_pop_vcpu_event(vcpu->id, &event)) == 0) {
+            if (vcpu_handle_trap(vcpu, &event) != 0) {
+                result = -1;
+                break;
+            }
+        }
+
+        if (result < 0) {
+            vcpu_mark_failed();
+            break;
+        }
+
+        int timeout = irq_prepare_sleep(vcpu->id) ? 0 : VCPU_POLL_TIMEOUT_MS;
+        fds[1].revents = 0;
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            log_error("vCPU %d poll failed: %s", vcpu->id, strerror(errno));
+        }
+        irq_wake(vcpu->id);
+        trap_ack_vcpu(vcpu->id);
+
+        if (fds[1].revents & POLLIN) {
+            timer_wheel_run(vcpu->timers);
+        }
+    }
+
+    for (int i = 0; i < VM_GUEST_TIMERS; i++) {
+        timer_cancel(vcpu->timers, &vcpu->guest_timers[i].timer);
+    }
+    timer_wheel_destroy(vcpu->timers);
+    vcpu->timers = NULL;
+    trap_unregister_thread();
+
+    current_vcpu = -1;
+    return NULL;
+}
+
+static void vm_join_vcpus(void) {
+    for (int i = 0; i < vm.vcpu_count; i++) {
+        if (vm.vcpus[i].started) {
+            pthread_join(vm.vcpus[i].thread, NULL);
+            vm.vcpus[i].started = 0;
+        }
+        trap_unregister_vcpu(i);
+    }
+}
+
+static void vm_memmap_changed(uint64_t start, uint64_t end, void *arg) {
+    (void)arg;
+    mmio_invalidate(start, end);
+}
+
+// Guest RAM is an anonymous mapping rather than heap memory so individual
+// pages can be remapped (dedup sharing, copy-on-write breaks, guest
+// mapping changes).
+static int vm_alloc_memory(uint64_t size) {
+    uint64_t page_size = sysconf(_SC_PAGESIZE);
+    size = (size + page_size - 1) & ~(page_size - 1);
+
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        log_error("Failed to allocate guest memory: %s", strerror(errno));
+        return -1;
+    }
+
+    if (memmap_init(memory, size, MEMMAP_READ | MEMMAP_WRITE) != 0 ||
+        memmap_add_invalidate_listener(vm_memmap_changed, NULL) != 0) {
+        memmap_cleanup();
+        munmap(memory, size);
+        return -1;
+    }
+
+    vm.memory = memory;
+    vm.memory_size = size;
+    trap_set_guest_region(memory, size);
+    trap_set_fault_resolver(vm_resolve_fault);
     return 0;
 }
 
+static int vm_apply_map_batch(const memmap_range_t *ranges, size_t count);
+
+// Device windows inside guest memory become holes, so accesses there fault
+// into the MMIO fast path instead of landing in RAM.
+static int vm_unmap_devices(void) {
+    memmap_range_t windows[MMIO_MAX_DEVICES];
+    size_t count = mmio_device_windows(windows, MMIO_MAX_DEVICES, sysconf(_SC_PAGESIZE));
+    size_t holes = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        if (windows[i].addr >= vm.memory_size) continue;
+        if (windows[i].size > vm.memory_size - windows[i].addr) {
+            windows[i].size = vm.memory_size - windows[i].addr;
+        }
+        windows[holes++] = windows[i];
+    }
+    return holes ? vm_apply_map_batch(windows, holes) : 0;
+}
+
+static void vm_free_memory(void) {
+    if (vm.memory) {
+        trap_set_fault_resolver(NULL);
+        trap_set_guest_region(NULL, 0);
+        memmap_cleanup();
+        munmap(vm.memory, vm.memory_size);
+    }
+    vm.memory = NULL;
+    vm.memory_size = 0;
+}
+
 int vm_start(vm_config_t *config) {
     if (vm.running) {
         log_error("VM is already running.");
         return -1;
     }
-    vm.memory = (uint64_t *)malloc(config->memory_size);
-    if (!vm.memory) {
-        log_error("Failed to allocate guest memory.");
+    if (config->cpu_count <= 0 || config->cpu_count > TRAP_MAX_VCPUS) {
+        log_error("Invalid vCPU count: %d", config->cpu_count);
+        return -1;
+    }
+    if (vm_alloc_memory(config->memory_size) != 0) {
         return -1;
     }
-    memset(vm.memory, 0, config->memory_size);
+    if (vm.restore && snapshot_map_memory(vm.restore, (uint8_t *)vm.memory, vm.memory_size) != 0) {
+        vm_free_memory();
+        return -1;
+    }
+    if (vm_unmap_devices() != 0) {
+        log_error("Failed to unmap MMIO device windows.");
+        vm_free_memory();
+        return -1;
+    }
+
+    thread_pool_config_t pool_config = {
+        .num_threads = config->trap_workers > 0 ? config->trap_workers : config->cpu_count,
+        .queue_size = config->trap_queue_size > 0 ? config->trap_queue_size
+                                                  : THREAD_POOL_DEFAULT_QUEUE_SIZE,
+        .policy = config->overflow_policy,
+        .drop_class_mask = 1u << TRAP_MEMORY,
+        .sample_rate = VM_TRAP_SAMPLE_RATE,
+        .spill_size = VM_TRAP_SPILL_SIZE
+    };
+    vm.pool = thread_pool_create_with_config(&pool_config);
+    if (!vm.pool) {
+        log_error("Failed to create trap thread pool.");
+        vm_free_memory();
+        return -1;
+    }
+
+    if (irq_init(config->cpu_count) != 0) {
+        log_error("Failed to initialize interrupt delivery.");
+        thread_pool_destroy(vm.pool);
+        vm.pool = NULL;
+        vm_free_memory();
+        return -1;
+    }
+
+    if (vm.restore && snapshot_restore_registrations(vm.restore) != 0) {
+        irq_cleanup();
+        thread_pool_destroy(vm.pool);
+        vm.pool = NULL;
+        vm_free_memory();
+        return -1;
+    }
+
+    vm.vcpus = calloc(config->cpu_count, sizeof(vcpu_t));
+    if (!vm.vcpus) {
+        log_error("Failed to allocate vCPU state.");
+        irq_cleanup();
+        thread_pool_destroy(vm.pool);
+        vm.pool = NULL;
+        vm_free_memory();
+        return -1;
+    }
+
     vm.vcpu_count = config->cpu_count;
-    vm.running = 1;
+    vm.run_state = VM_RUN_STARTING;
+    vm.parked = 0;
+    vm.failed = 0;
+
+    for (int i = 0; i < vm.vcpu_count; i++) {
+        vm.vcpus[i].id = i;
+        if (trap_register_vcpu(i) != 0 ||
+            pthread_create(&vm.vcpus[i].thread, NULL, vcpu_loop, &vm.vcpus[i]) != 0) {
+            log_error("Failed to start vCPU %d.", i);
+            vm_set_run_state(VM_RUN_STOPPING);
+            vm_join_vcpus();
+            free(vm.vcpus);
+            vm.vcpus = NULL;
+            vm.vcpu_count = 0;
+            irq_cleanup();
+            thread_pool_destroy(vm.pool);
+            vm.pool = NULL;
+            vm_free_memory();
+            return -1;
+        }
+        vm.vcpus[i].started = 1;
+    }
+
+    if (config->dedup_pages_per_round) {
+        dedup_config_t dedup_config = {
+            .pages_per_round = config->dedup_pages_per_round,
+            .round_interval_ms = config->dedup_interval_ms ? config->dedup_interval_ms
+                                                           : VM_DEDUP_DEFAULT_INTERVAL_MS
+        };
+        if (dedup_start(vm.memory, vm.memory_size, &dedup_config) != 0) {
+            log_warn("Guest memory dedup disabled: service failed to start.");
+        }
+    }
+
+    if (vm.restore) {
+        snapshot_start_prefetch(vm.restore);
+    }
+
+    vm.config = *config;
+    atomic_store(&vm.running, 1);
+
+    // Release every vCPU at once so none runs ahead of the others' setup.
+    vm_set_run_state(VM_RUN_RUNNING);
     log_info("VM started with %d vCPUs and %llu bytes of memory.", vm.vcpu_count, config->memory_size);
     return 0;
 }
@@ -43,55 +509,454 @@ int vm_poll(void) {
         return -1;
     }
     log_debug("Polling VM events...");
-    trap_event_t event;
-    while (trap_wait_for_event(&event) == 0) {
-        switch (event.type) {
-            case TRAP_SYSCALL:
-                log_info("Intercepted syscall from guest.");
-                if (handle_syscall(&event) != 0) {
-                    log_error("Failed to handle syscall.");
-                    return -1;
-                }
-                break;
-            case TRAP_MEMORY:
-                log_info("Intercepted memory access from guest.");
-                if (handle_memory_access(&event) != 0) {
-                    log_error("Failed to handle memory access.");
-                    return -1;
-                }
-                break;
-            case TRAP_EXCEPTION:
-                log_info("Intercepted exception from guest.");
-                if (handle_exception(&event) != 0) {
-                    log_error("Failed to handle exception.");
-                    return -1;
-                }
-                break;
-            default:
-                log_warn("Unknown trap type encountered: %d", event.type);
-                break;
+
+    // Traps are consumed by the trap subsystem and the vCPU loops; this
+    // thread only supervises them and publishes metrics while it waits.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += VM_SUPERVISE_TIMEOUT_SEC;
+
+    int failed = 0;
+    int stopping = 0;
+    int timed_out = 0;
+
+    while (!failed && !stopping && !timed_out) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += VM_METRICS_POLL_MS * 1000000l;
+        if (wake.tv_nsec >= 1000000000l) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000l;
+        }
+        if (wake.tv_sec > deadline.tv_sec ||
+            (wake.tv_sec == deadline.tv_sec && wake.tv_nsec >= deadline.tv_nsec)) {
+            wake = deadline;
+            timed_out = 1;
+        }
+
+        pthread_mutex_lock(&vm.lock);
+        if (!vm.failed && vm.run_state != VM_RUN_STOPPING) {
+            pthread_cond_timedwait(&vm.state_changed, &vm.lock, &wake);
+        }
+        failed = vm.failed;
+        stopping = vm.run_state == VM_RUN_STOPPING;
+        pthread_mutex_unlock(&vm.lock);
+
+        metrics_publish(vm.pool);
+    }
+
+    if (failed) {
+        log_error("A vCPU stopped after a trap handling failure.");
+        return -1;
+    }
+    return 0;
+}
+
+int vm_pause(void) {
+    if (!vm.running) {
+        log_error("VM is not running.");
+        return -1;
+    }
+
+    vm_set_run_state(VM_RUN_PAUSED);
+
+    pthread_mutex_lock(&vm.lock);
+    while (vm.parked < vm.vcpu_count && !vm.failed) {
+        pthread_cond_wait(&vm.state_changed, &vm.lock);
+    }
+    int failed = vm.failed;
+    pthread_mutex_unlock(&vm.lock);
+
+    if (failed) {
+        log_error("Cannot pause VM: a vCPU has failed.");
+        return -1;
+    }
+    log_info("VM paused.");
+    return 0;
+}
+
+int vm_resume(void) {
+    if (!vm.running) {
+        log_error("VM is not running.");
+        return -1;
+    }
+
+    vm_set_run_state(VM_RUN_RUNNING);
+    log_info("VM resumed.");
+    return 0;
+}
+
+static void guest_timer_fire(wheel_timer_t *timer, void *arg) {
+    guest_timer_t *guest_timer = (guest_timer_t *)arg;
+
+    irq_raise(guest_timer->vcpu_id, guest_timer->irq);
+
+    // Periodic timers advance from the previous deadline, not from now,
+    // so late wakeups don't accumulate drift.
+    if (guest_timer->period_ns) {
+        guest_timer->deadline_ns += guest_timer->period_ns;
+        timer_arm(vm.vcpus[guest_timer->vcpu_id].timers, timer, guest_timer->deadline_ns);
+    }
+}
+
+// Runs on the vCPU that owns the wheel.
+static void vcpu_apply_timer_request(vcpu_t *vcpu, const vm_timer_request_t *request) {
+    guest_timer_t *guest_timer = &vcpu->guest_timers[request->timer_id];
+
+    switch (request->op) {
+        case VM_TIMER_ARM_GUEST:
+            if (!guest_timer->timer.fn) {
+                timer_init(&guest_timer->timer, guest_timer_fire, guest_timer);
+            }
+            guest_timer->vcpu_id = vcpu->id;
+            guest_timer->irq = request->irq;
+            guest_timer->period_ns = request->period_ns;
+            guest_timer->deadline_ns = request->deadline_ns;
+            timer_arm(vcpu->timers, &guest_timer->timer, guest_timer->deadline_ns);
+            break;
+        case VM_TIMER_CANCEL_GUEST:
+            timer_cancel(vcpu->timers, &guest_timer->timer);
+            break;
+        case VM_TIMER_ARM_CALLBACK:
+            timer_arm(vcpu->timers, request->timer, request->deadline_ns);
+            break;
+        case VM_TIMER_CANCEL_CALLBACK:
+            timer_cancel(vcpu->timers, request->timer);
+            break;
+    }
+}
+
+// Applies the request right away on the target vCPU's own thread; from any
+// other thread it is queued and the vCPU is kicked to pick it up.
+static int vm_timer_request(int vcpu_id, const vm_timer_request_t *request) {
+    if (vcpu_id == VM_CALLING_VCPU) {
+        if (current_vcpu < 0) {
+            log_error("Timer requests from outside a vCPU thread must name a vCPU.");
+            return -1;
         }
+        vcpu_id = current_vcpu;
+    }
+    if (!vm.running || vcpu_id < 0 || vcpu_id >= vm.vcpu_count) {
+        log_error("Timer request for invalid vCPU %d.", vcpu_id);
+        return -1;
+    }
+
+    vcpu_t *vcpu = &vm.vcpus[vcpu_id];
+    if (vcpu_id == current_vcpu) {
+        vcpu_apply_timer_request(vcpu, request);
+        return 0;
+    }
+
+    pthread_mutex_lock(&vm.lock);
+    int count = atomic_load_explicit(&vcpu->timer_request_count, memory_order_relaxed);
+    if (count == VM_TIMER_REQUESTS) {
+        pthread_mutex_unlock(&vm.lock);
+        log_warn("vCPU %d timer request queue full.", vcpu_id);
+        return -1;
+    }
+    vcpu->timer_requests[count] = *request;
+    atomic_store_explicit(&vcpu->timer_request_count, count + 1, memory_order_release);
+    pthread_mutex_unlock(&vm.lock);
+
+    trap_kick_vcpu(vcpu_id);
+    return 0;
+}
+
+int vm_arm_guest_timer(int vcpu_id, uint32_t timer_id, uint32_t irq,
+                       uint64_t delay_ns, uint64_t period_ns) {
+    if (timer_id >= VM_GUEST_TIMERS || irq >= IRQ_MAX) {
+        log_error("Invalid guest timer %u or IRQ %u", timer_id, irq);
+        return -1;
+    }
+
+    vm_timer_request_t request = {
+        .op = VM_TIMER_ARM_GUEST,
+        .timer_id = timer_id,
+        .irq = irq,
+        .deadline_ns = timer_now_ns() + delay_ns,
+        .period_ns = period_ns
+    };
+    return vm_timer_request(vcpu_id, &request);
+}
+
+int vm_cancel_guest_timer(int vcpu_id, uint32_t timer_id) {
+    if (timer_id >= VM_GUEST_TIMERS) {
+        log_error("Invalid guest timer %u", timer_id);
+        return -1;
+    }
+
+    vm_timer_request_t request = { .op = VM_TIMER_CANCEL_GUEST, .timer_id = timer_id };
+    return vm_timer_request(vcpu_id, &request);
+}
+
+int vm_schedule_callback(int vcpu_id, wheel_timer_t *timer, uint64_t delay_ns) {
+    vm_timer_request_t request = {
+        .op = VM_TIMER_ARM_CALLBACK,
+        .timer = timer,
+        .deadline_ns = timer_now_ns() + delay_ns
+    };
+    return vm_timer_request(vcpu_id, &request);
+}
+
+void vm_cancel_callback(int vcpu_id, wheel_timer_t *timer) {
+    vm_timer_request_t request = { .op = VM_TIMER_CANCEL_CALLBACK, .timer = timer };
+    vm_timer_request(vcpu_id, &request);
+}
+
+int vm_scan_memory(uint64_t guest_addr, uint64_t len, const uint8_t *pattern,
+                   const uint8_t *mask, size_t pattern_len,
+                   uint64_t *matches, size_t max_matches) {
+    if (!vm.running) {
+        log_error("VM is not running.");
+        return -1;
+    }
+
+    if (!pattern || pattern_len == 0 || guest_addr > vm.memory_size ||
+        len > vm.memory_size - guest_addr) {
+        log_error("Invalid guest memory scan: 0x%llx+0x%llx", guest_addr, len);
+        return -1;
+    }
+
+    if (vm.restore && snapshot_make_resident(vm.restore, guest_addr, len) != 0) {
+        return -1;
+    }
+
+    if (memmap_acquire(guest_addr, len, MEMMAP_READ) != 0) {
+        log_error("Guest memory scan covers unreadable pages: 0x%llx+0x%llx", guest_addr, len);
+        return -1;
+    }
+
+    const uint8_t *base = (const uint8_t *)vm.memory;
+    const uint8_t *cursor = base + guest_addr;
+    const uint8_t *end = cursor + len;
+    size_t found = 0;
+
+    while (found < max_matches && cursor < end) {
+        const uint8_t *hit = scan_pattern(cursor, end - cursor, pattern, mask, pattern_len);
+        if (!hit) break;
+
+        matches[found++] = hit - base;
+        cursor = hit + 1;
+    }
+    memmap_release();
+
+    return (int)found;
+}
+
+int vm_get_info(vm_info_t *info) {
+    if (!vm.running || !info) {
+        return -1;
+    }
+
+    info->memory_size = vm.memory_size;
+    info->vcpu_count = vm.vcpu_count;
+    info->features = 0;
+    return 0;
+}
+
+static uint8_t *vm_guest_range(uint64_t guest_addr, size_t len) {
+    if (!vm.running || guest_addr > vm.memory_size || len > vm.memory_size - guest_addr) {
+        log_error("Invalid guest memory access: 0x%llx+0x%zx", guest_addr, len);
+        return NULL;
+    }
+
+    if (vm.restore && snapshot_make_resident(vm.restore, guest_addr, len) != 0) {
+        return NULL;
+    }
+    return (uint8_t *)vm.memory + guest_addr;
+}
+
+// The map stays held across the copy so a concurrent batch can't revoke
+// the range halfway through it.
+int vm_read_memory(const void *guest_src, void *dst, size_t len) {
+    uint8_t *host = vm_guest_range((uintptr_t)guest_src, len);
+    if (!host) return -1;
+
+    if (memmap_acquire((uintptr_t)guest_src, len, MEMMAP_READ) != 0) {
+        log_error("Guest memory not readable: 0x%llx+0x%zx", (uint64_t)(uintptr_t)guest_src, len);
+        return -1;
+    }
+    memcpy(dst, host, len);
+    memmap_release();
+    return 0;
+}
+
+int vm_write_memory(const void *src, void *guest_dst, size_t len) {
+    uint8_t *host = vm_guest_range((uintptr_t)guest_dst, len);
+    if (!host) return -1;
+
+    if (memmap_acquire((uintptr_t)guest_dst, len, MEMMAP_WRITE) != 0) {
+        log_error("Guest memory not writable: 0x%llx+0x%zx", (uint64_t)(uintptr_t)guest_dst, len);
+        return -1;
+    }
+
+    // This thread has no fault capture, so the range must stay private
+    // and writable for the whole copy: pinning unshares it and keeps the
+    // dedup scanner from freezing it meanwhile.
+    if (dedup_pin(host, len) != 0) {
+        dedup_unpin(host, len);
+        memmap_release();
+        log_error("Failed to make guest memory private: 0x%llx+0x%zx",
+                  (uint64_t)(uintptr_t)guest_dst, len);
+        return -1;
     }
+
+    memcpy(host, src, len);
+    dedup_unpin(host, len);
+    memmap_release();
     return 0;
 }
 
+static int vm_apply_map_batch(const memmap_range_t *ranges, size_t count) {
+    // Chunks a restore hasn't filled yet are PROT_NONE placeholders; fill
+    // them now or the fill would later undo the new protection.
+    if (vm.restore) {
+        for (size_t i = 0; i < count; i++) {
+            if (ranges[i].addr < vm.memory_size && ranges[i].size <= vm.memory_size - ranges[i].addr &&
+                snapshot_make_resident(vm.restore, ranges[i].addr, ranges[i].size) != 0) {
+                return -1;
+            }
+        }
+    }
+    return memmap_apply(ranges, count);
+}
+
+int vm_map_batch(const memmap_range_t *ranges, size_t count) {
+    if (!vm.running) {
+        log_error("VM is not running.");
+        return -1;
+    }
+    return vm_apply_map_batch(ranges, count);
+}
+
+int vm_map_memory(uint64_t guest_addr, uint64_t size, uint32_t flags) {
+    memmap_range_t range = { .addr = guest_addr, .size = size, .flags = flags };
+    return vm_map_batch(&range, 1);
+}
+
+int vm_unmap_memory(uint64_t guest_addr, uint64_t size) {
+    return vm_map_memory(guest_addr, size, 0);
+}
+
+int vm_submit_task(pool_task_t *task) {
+    if (!vm.running || !vm.pool) {
+        return -1;
+    }
+    return thread_pool_submit_task(vm.pool, task);
+}
+
+int vm_register_irq_handler(uint32_t irq, uint64_t handler) {
+    if (!vm.running) {
+        log_error("VM is not running.");
+        return -1;
+    }
+    return irq_register_handler(irq, handler);
+}
+
+int vm_raise_irq(int vcpu_id, uint32_t irq) {
+    return irq_raise(vcpu_id, irq);
+}
+
 void vm_stop(void) {
     if (!vm.running) {
         log_error("VM is not running.");
         return;
     }
     log_info("Stopping VM...");
-    free(vm.memory);
-    vm.memory = NULL;
-    vm.running = 0;
+    vm_set_run_state(VM_RUN_STOPPING);
+    vm_join_vcpus();
+
+    // Drains whatever the vCPUs already handed off before tearing down.
+    // Hooks may still raise interrupts until the pool is gone.
+    thread_pool_destroy(vm.pool);
+    vm.pool = NULL;
+    irq_cleanup();
+
+    free(vm.vcpus);
+    vm.vcpus = NULL;
+    dedup_stop();
+    if (vm.restore) {
+        snapshot_close(vm.restore);
+        vm.restore = NULL;
+    }
+    vm_free_memory();
+    atomic_store(&vm.running, 0);
     vm.vcpu_count = 0;
     log_info("VM stopped.");
 }
 
+static int vm_page_readable(uint64_t offset, void *arg) {
+    (void)arg;
+    memmap_range_t range;
+    return memmap_lookup(offset, &range) == 0 && (range.flags & MEMMAP_READ);
+}
+
+int vm_snapshot(const char *path) {
+    if (!vm.running) {
+        log_error("VM is not running.");
+        return -1;
+    }
+
+    if (vm_pause() != 0) {
+        return -1;
+    }
+
+    // The writer reads guest memory directly, so anything a restore hasn't
+    // filled yet has to be brought in first.
+    int result = 0;
+    if (vm.restore) {
+        result = snapshot_make_resident(vm.restore, 0, vm.memory_size);
+    }
+
+    if (result == 0) {
+        snapshot_source_t source = {
+            .memory = (const uint8_t *)vm.memory,
+            .memory_size = vm.memory_size,
+            .config = &vm.config,
+            .readable = vm_page_readable
+        };
+        result = snapshot_write(path, &source, 0, NULL);
+    }
+
+    vm_resume();
+    return result;
+}
+
+int vm_restore(const char *path) {
+    if (vm.running) {
+        log_error("VM is already running.");
+        return -1;
+    }
+
+    snapshot_t *snap = snapshot_open(path);
+    if (!snap) {
+        return -1;
+    }
+
+    vm_config_t config;
+    snapshot_get_config(snap, &config);
+    // The dedup scanner reads every page and would trip over chunks that
+    // are still compressed.
+    if (config.dedup_pages_per_round) {
+        log_warn("Guest memory dedup disabled for a restored VM.");
+        config.dedup_pages_per_round = 0;
+    }
+
+    vm.restore = snap;
+    if (vm_start(&config) != 0) {
+        vm.restore = NULL;
+        snapshot_close(snap);
+        return -1;
+    }
+    return 0;
+}
+
 void vm_cleanup(void) {
     if (vm.running) {
         log_warn("VM is still running during cleanup. Stopping it now...");
         vm_stop();
     }
+    pthread_cond_destroy(&vm.state_changed);
+    pthread_mutex_destroy(&vm.lock);
     log_info("VM subsystem cleaned up.");
 }
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "metrics.h"
+#include "hook.h"
+
+// Live view of a running hypervisor's metrics segment. Reads shared memory
+// only, so watching costs the hypervisor nothing.
+//
+//   ./ghostvisor-top [pid | /shm-name] [interval-ms] [--once]
+
+#define TOP_DEFAULT_INTERVAL_MS 1000
+#define TOP_RECENT_EVENTS 8
+#define TOP_MAX_HOOK_ROWS 20
+
+static const char *trap_names[METRICS_TRAP_TYPES] = { "syscall", "memory", "exception" };
+static const char *hook_names[] = {
+    [HOOK_TYPE_SYSCALL] = "syscall",
+    [HOOK_TYPE_MEMORY] = "memory",
+    [HOOK_TYPE_EXCEPTION] = "exception"
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int find_segment(char *name, size_t len) {
+    DIR *dir = opendir("/dev/shm");
+    if (!dir) return -1;
+
+    const char *prefix = METRICS_SHM_PREFIX + 1;
+    struct dirent *entry;
+    int found = -1;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, prefix, strlen(prefix)) == 0) {
+            snprintf(name, len, "/%s", entry->d_name);
+            found = 0;
+            break;
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+static const metrics_segment_t *open_segment(const char *name) {
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    const metrics_segment_t *segment = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(metrics_segment_t)) {
+        segment = mmap(NULL, sizeof(metrics_segment_t), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "%s is not a metrics segment\n", name);
+        return NULL;
+    }
+
+    if (__atomic_load_n(&segment->header.magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+        segment->header.version != METRICS_VERSION ||
+        segment->header.size != sizeof(metrics_segment_t)) {
+        fprintf(stderr, "%s: unsupported metrics layout (version %u)\n", name,
+                segment->header.version);
+        munmap((void *)segment, sizeof(metrics_segment_t));
+        return NULL;
+    }
+    return segment;
+}
+
+// Seqlock read: retry while the publisher is mid-update.
+static uint64_t read_snapshot(const metrics_segment_t *segment, metrics_snapshot_t *out) {
+    while (1) {
+        uint64_t seq = __atomic_load_n(&segment->header.seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, &segment->snapshot, sizeof(*out));
+        uint64_t updated = segment->header.updated_ns;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&segment->header.seq, __ATOMIC_RELAXED) == seq) {
+            return updated;
+        }
+    }
+}
+
+static int read_event(const metrics_segment_t *segment, uint64_t index, metrics_event_t *out) {
+    const metrics_event_t *entry = &segment->events[index % METRICS_EVENT_RING_SIZE];
+    uint64_t seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (seq != index + 1) {
+        return -1;
+    }
+    memcpy(out, entry, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
+
+// Upper bound of the bucket holding the given fraction of calls.
+static uint64_t percentile_ns(const metrics_hook_t *hook, double fraction) {
+    uint64_t target = (uint64_t)(hook->calls * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+        seen += hook->buckets[i];
+        if (seen > target) {
+            return 1ull << (i + 8);
+        }
+    }
+    return hook->max_ns;
+}
+
+static double rate(uint64_t now, uint64_t before, double seconds) {
+    return seconds > 0 ? (now - before) / seconds : 0.0;
+}
+
+static void render(const metrics_segment_t *segment, const metrics_snapshot_t *snap,
+                   const metrics_snapshot_t *prev, const uint64_t *traps,
+                   const uint64_t *prev_traps, double seconds, int clear) {
+    if (clear) {
+        printf("\033[H\033[2J");
+    }
+
+    double uptime = (now_ns() - segment->header.start_ns) / 1e9;
+    printf("ghostvisor pid %d  up %.0fs  interval %ums\n\n", segment->header.pid, uptime,
+           segment->header.interval_ms);
+
+    printf("Traps/s:");
+    for (int i = 0; i < METRICS_TRAP_TYPES; i++) {
+        printf("  %s %.0f", trap_names[i], rate(traps[i], prev_traps[i], seconds));
+    }
+    printf("\n");
+
+    const metrics_pool_t *pool = &snap->pool;
+    printf("Queue:   depth %d  spill %d  submitted/s %.0f  processed/s %.0f  dropped %llu  tasks %llu\n",
+           pool->queue_depth, pool->spill_depth,
+           rate(pool->submitted, prev->pool.submitted, seconds),
+           rate(pool->processed, prev->pool.processed, seconds),
+           (unsigned long long)pool->dropped, (unsigned long long)pool->tasks);
+    printf("Dedup:   %llu pages shared, %llu KiB saved   MMIO: %llu accesses, %llu cache hits\n\n",
+           (unsigned long long)snap->dedup_pages_shared,
+           (unsigned long long)(snap->dedup_bytes_saved / 1024),
+           (unsigned long long)snap->mmio_accesses, (unsigned long long)snap->mmio_cache_hits);
+
+    printf("%-9s %-24s %-20s %10s %9s %9s %9s %9s %9s\n", "HOOK", "KEY", "SYMBOL", "CALLS",
+           "CALLS/s", "AVG us", "P50 us", "P99 us", "MAX us");
+    for (uint32_t i = 0; i < snap->hook_count && i < TOP_MAX_HOOK_ROWS; i++) {
+        const metrics_hook_t *hook = &snap->hooks[i];
+        uint64_t before = i < prev->hook_count ? prev->hooks[i].calls : 0;
+        char key[32];
+        if (hook->type == HOOK_TYPE_MEMORY) {
+            snprintf(key, sizeof(key), "0x%llx-0x%llx", (unsigned long long)hook->region_start,
+                     (unsigned long long)hook->region_end);
+        } else {
+            snprintf(key, sizeof(key), "%llu", (unsigned long long)hook->id);
+        }
+        printf("%-9s %-24s %-20s %10llu %9.0f %9.2f %9.2f %9.2f %9.2f\n",
+               hook->type <= HOOK_TYPE_EXCEPTION ? hook_names[hook->type] : "?", key,
+               hook->symbol[0] ? hook->symbol : "-", (unsigned long long)hook->calls,
+               rate(hook->calls, before, seconds),
+               hook->calls ? hook->total_ns / 1e3 / hook->calls : 0.0,
+               percentile_ns(hook, 0.5) / 1e3, percentile_ns(hook, 0.99) / 1e3,
+               hook->max_ns / 1e3);
+    }
+
+    int header = 0;
+    for (int nr = 0; nr < METRICS_MAX_HYPERCALLS; nr++) {
+        const metrics_hypercall_t *hc = &snap->hypercalls[nr];
+        if (!hc->calls) continue;
+        if (!header) {
+            printf("\n%-9s %10s %10s %10s %9s %9s\n", "HCALL", "CALLS", "ASYNC", "FAILED",
+                   "AVG us", "MAX us");
+            header = 1;
+        }
+        printf("%-9d %10llu %10llu %10llu %9.2f %9.2f\n", nr, (unsigned long long)hc->calls,
+               (unsigned long long)hc->async_calls, (unsigned long long)hc->failures,
+               hc->total_ns / 1e3 / hc->calls, hc->max_ns / 1e3);
+    }
+
+    uint64_t head = __atomic_load_n(&segment->event_head, __ATOMIC_ACQUIRE);
+    printf("\nRecent traps (%llu total):\n", (unsigned long long)head);
+    uint64_t first = head > TOP_RECENT_EVENTS ? head - TOP_RECENT_EVENTS : 0;
+    for (uint64_t i = first; i < head; i++) {
+        metrics_event_t event;
+        if (read_event(segment, i, &event) != 0) continue;
+        printf("  %+10.3fs  %-9s addr 0x%016llx data 0x%llx\n",
+               ((double)event.time_ns - segment->header.start_ns) / 1e9,
+               event.type < METRICS_TRAP_TYPES ? trap_names[event.type] : "?",
+               (unsigned long long)event.address, (unsigned long long)event.data);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    char name[NAME_MAX + 2] = {0};   // leading slash + d_name
+    unsigned interval_ms = TOP_DEFAULT_INTERVAL_MS;
+    int once = 0;
+    int positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--once") == 0) {
+            once = 1;
+        } else if (positional == 0 && argv[i][0] == '/') {
+            snprintf(name, sizeof(name), "%s", argv[i]);
+            positional++;
+        } else if (positional == 0) {
+            snprintf(name, sizeof(name), METRICS_SHM_PREFIX "%s", argv[i]);
+            positional++;
+        } else if (positional == 1) {
+            interval_ms = strtoul(argv[i], NULL, 10);
+            positional++;
+        } else {
+            fprintf(stderr, "Usage: %s [pid | /shm-name] [interval-ms] [--once]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!name[0] && find_segment(name, sizeof(name)) != 0) {
+        fprintf(stderr, "No running ghostvisor found (start it with --metrics)\n");
+        return EXIT_FAILURE;
+    }
+    if (interval_ms == 0) {
+        interval_ms = TOP_DEFAULT_INTERVAL_MS;
+    }
+
+    const metrics_segment_t *segment = open_segment(name);
+    if (!segment) {
+        return EXIT_FAILURE;
+    }
+
+    static metrics_snapshot_t snapshots[2];
+    uint64_t traps[2][METRICS_TRAP_TYPES] = {{0}};
+    int cur = 0;
+
+    read_snapshot(segment, &snapshots[cur]);
+    for (int i = 0; i < METRICS_TRAP_TYPES; i++) {
+        traps[cur][i] = __atomic_load_n(&segment->traps[i], __ATOMIC_RELAXED);
+    }
+    uint64_t last = now_ns();
+
+    while (1) {
+        struct timespec pause = { interval_ms / 1000, (interval_ms % 1000) * 1000000l };
+        nanosleep(&pause, NULL);
+
+        int next = cur ^ 1;
+        read_snapshot(segment, &snapshots[next]);
+        for (int i = 0; i < METRICS_TRAP_TYPES; i++) {
+            traps[next][i] = __atomic_load_n(&segment->traps[i], __ATOMIC_RELAXED);
+        }
+        uint64_t now = now_ns();
+
+        render(segment, &snapshots[next], &snapshots[cur], traps[next], traps[cur],
+               (now - last) / 1e9, !once);
+        cur = next;
+        last = now;
+
+        if (once) break;
+        if (kill(segment->header.pid, 0) != 0 && errno == ESRCH) {
+            printf("\nghostvisor %d exited\n", segment->header.pid);
+            break;
+        }
+    }
+
+    munmap((void *)segment, sizeof(metrics_segment_t));
+    return EXIT_SUCCESS;
+}